@@ -0,0 +1,79 @@
+// ICE candidate batches as exchanged through the signaling server.
+//
+// A "candidates:" message carries one "<mlineindex> <candidate>\n" line per
+// candidate. A batch is cut before its frame would exceed
+// CANDIDATES_MAX_FRAME and the rest goes out in the next message, so a
+// frame stays short and still fits peers with a fixed 4 KB buffer.
+#ifndef CANDIDATES_H
+#define CANDIDATES_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CANDIDATES_PREFIX "candidates:"
+#define CANDIDATES_PREFIX_LEN 11
+#define CANDIDATES_MAX_FRAME 3584
+
+// Whether a line of line_len bytes still fits into a frame whose lines
+// already take batch_len bytes. An empty batch always takes one line.
+static inline int candidates_fit(size_t batch_len, size_t line_len)
+{
+    return batch_len == 0 ||
+           CANDIDATES_PREFIX_LEN + batch_len + line_len <= CANDIDATES_MAX_FRAME;
+}
+
+// Length of the longest run of whole lines at the start of lines[0..len)
+// that fits into one frame
+static inline size_t candidates_frame_len(const char *lines, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len) {
+        const char *nl = memchr(lines + n, '\n', len - n);
+        size_t line_len = nl ? (size_t)(nl - (lines + n)) + 1 : len - n;
+        if (!candidates_fit(n, line_len))
+            break;
+        n += line_len;
+    }
+    return n;
+}
+
+// Call add(mlineindex, candidate, user) for every well-formed line
+static inline void candidates_for_each(const char *lines,
+                                       void (*add)(unsigned mline, const char *candidate,
+                                                   void *user),
+                                       void *user)
+{
+    char *copy = strdup(lines), *save = NULL, *line;
+
+    if (!copy)
+        return;
+    for (line = strtok_r(copy, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *cand = NULL;
+        unsigned long mline = strtoul(line, &cand, 10);
+        if (cand == line || *cand != ' ')
+            continue;
+        add((unsigned)mline, cand + 1, user);
+    }
+    free(copy);
+}
+
+#ifdef __G_LIB_H__
+// Add a local candidate to the batch. If the batch is full it is first
+// moved to the outbox as a complete message, after `route` (e.g. the SFU's
+// "to:<id>:"). The caller holds the outbox lock.
+static inline void candidates_batch_add(GString *batch, GQueue *outbox, const char *route,
+                                        unsigned mline, const char *candidate)
+{
+    gchar *line = g_strdup_printf("%u %s\n", mline, candidate);
+
+    if (!candidates_fit(batch->len, strlen(line))) {
+        g_queue_push_tail(outbox, g_strdup_printf("%s" CANDIDATES_PREFIX "%s", route, batch->str));
+        g_string_truncate(batch, 0);
+    }
+    g_string_append(batch, line);
+    g_free(line);
+}
+#endif
+
+#endif
@@ -2,25 +2,162 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <time.h>
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
 
+// Sweep mode (-S): payload sizes double from min to max, each echoed
+// back-to-back for a fixed time
+#define DEFAULT_SWEEP_MIN 64
+#define DEFAULT_SWEEP_MAX (1024 * 1024)
+#define DEFAULT_SWEEP_SECONDS 2
+#define MAX_SAMPLES 1000000
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Send the payload and read the whole echo back, interleaved so that
+// neither side can fill its buffers and stall the other.
+// Returns -1 if the server went away, 1 if the echo did not match.
+static int echo_once(int sock, const char *payload, char *reply, size_t size) {
+    size_t sent = 0, received = 0;
+
+    while (received < size) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        if (sent < size)
+            pfd.events |= POLLOUT;
+
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (pfd.revents & (POLLERR | POLLNVAL))
+            return -1;
+
+        if ((pfd.revents & POLLOUT) && sent < size) {
+            ssize_t n = send(sock, payload + sent, size - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                return -1;
+            if (n > 0)
+                sent += n;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(sock, reply + received, size - received);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+                return -1;
+            if (n > 0)
+                received += n;
+        }
+    }
+    return memcmp(payload, reply, size) ? 1 : 0;
+}
+
+// Echo each payload size for `seconds` and print one line per size
+static int run_sweep(int sock, size_t min_size, size_t max_size, double seconds) {
+    char *payload = malloc(max_size), *reply = malloc(max_size);
+    double *rtt = malloc(MAX_SAMPLES * sizeof(*rtt));
+
+    if (!payload || !reply || !rtt) {
+        perror("Allocation failed");
+        return -1;
+    }
+    for (size_t i = 0; i < max_size; i++)
+        payload[i] = (char)(i * 31 + 7);
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    printf("%10s %10s %10s %10s %10s %10s\n",
+           "size", "echoes/s", "MB/s", "p50_us", "p99_us", "mismatch");
+    for (size_t size = min_size; size <= max_size; size *= 2) {
+        double start = now_seconds(), end = start + seconds, t = start;
+        unsigned long n = 0, mismatches = 0;
+
+        while (t < end && n < MAX_SAMPLES) {
+            int r = echo_once(sock, payload, reply, size);
+            double done = now_seconds();
+            if (r < 0) {
+                printf("Server disconnected.\n");
+                free(payload);
+                free(reply);
+                free(rtt);
+                return -1;
+            }
+            mismatches += r;
+            rtt[n++] = (done - t) * 1e6;
+            t = done;
+        }
+
+        qsort(rtt, n, sizeof(*rtt), compare_doubles);
+        printf("%10zu %10.0f %10.1f %10.0f %10.0f %10lu\n",
+               size, n / (t - start), n * size / (t - start) / 1e6,
+               rtt[n / 2], rtt[n * 99 / 100], mismatches);
+        fflush(stdout);
+
+        if (size > max_size / 2)
+            break;
+    }
+
+    free(payload);
+    free(reply);
+    free(rtt);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <client_id>\n"
+            "       %s -S [-a min_bytes] [-z max_bytes] [-d seconds_per_size]\n"
+            "  -S sweeps payload sizes from min to max (default %d to %d bytes,\n"
+            "     doubling) and reports echo rate, throughput and round-trip times.\n",
+            prog, prog, DEFAULT_SWEEP_MIN, DEFAULT_SWEEP_MAX);
+}
+
 int main(int argc, char *argv[]) {
     int sock;
     struct sockaddr_in server_addr;
     char buffer[BUFFER_SIZE] = {0};
     char message[BUFFER_SIZE];
+    int sweep = 0, opt;
+    size_t sweep_min = DEFAULT_SWEEP_MIN, sweep_max = DEFAULT_SWEEP_MAX;
+    double sweep_seconds = DEFAULT_SWEEP_SECONDS;
+
+    while ((opt = getopt(argc, argv, "Sa:z:d:h")) != -1) {
+        switch (opt) {
+        case 'S': sweep = 1; break;
+        case 'a': sweep_min = strtoul(optarg, NULL, 10); break;
+        case 'z': sweep_max = strtoul(optarg, NULL, 10); break;
+        case 'd': sweep_seconds = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
 
     // Ensure the client ID is passed as a command-line argument
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <client_id>\n", argv[0]);
+    if (!sweep && optind != argc - 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (sweep && (sweep_min == 0 || sweep_min > sweep_max)) {
+        fprintf(stderr, "Need 0 < min_bytes <= max_bytes\n");
         exit(EXIT_FAILURE);
     }
 
-    int client_id = atoi(argv[1]);
+    int client_id = sweep ? 0 : atoi(argv[optind]);
 
     // Create socket
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -48,6 +185,12 @@ int main(int argc, char *argv[]) {
 
     printf("Connected to the server.\n");
 
+    if (sweep) {
+        int r = run_sweep(sock, sweep_min, sweep_max, sweep_seconds);
+        close(sock);
+        return r < 0 ? EXIT_FAILURE : 0;
+    }
+
     // Message exchange loop
     while (1) {
         // Prepare the message to send
@@ -0,0 +1,175 @@
+// Listening-socket handover between an old and a new server process.
+//
+// The running (old) process listens on a Unix socket. A new process started
+// in takeover mode connects to it and receives the listening sockets via
+// SCM_RIGHTS, starts accepting on them, then acknowledges. Once the ack
+// arrives the old process stops accepting and drains its connections.
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define HANDOVER_MAX_FDS 8
+#define HANDOVER_ACK_TIMEOUT_MS 5000
+
+// Old process: listen for takeover requests on `path`. Returns the fd or -1.
+static int handover_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Handover path too long: %s\n", path);
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Handover socket creation failed");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // A stale path is either ours from a crash or the previous process's,
+    // which has already handed over to us
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("Handover bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Old process: accept one takeover request on `listen_fd` and pass `fds` to
+// it. Returns 0 once the new process has acknowledged, -1 otherwise (in which
+// case the caller should keep serving).
+static int handover_send(int listen_fd, const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+    char tag = 'H', ack = 0;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd;
+    int conn;
+
+    if (nfds > HANDOVER_MAX_FDS)
+        return -1;
+
+    if ((conn = accept(listen_fd, NULL, NULL)) < 0) {
+        perror("Handover accept failed");
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0) {
+        perror("Handover sendmsg failed");
+        close(conn);
+        return -1;
+    }
+
+    // Wait for the new process to confirm it is accepting
+    pfd.fd = conn;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, HANDOVER_ACK_TIMEOUT_MS) <= 0 ||
+        read(conn, &ack, 1) != 1 || ack != 'A') {
+        fprintf(stderr, "Handover not acknowledged, continuing to serve\n");
+        close(conn);
+        return -1;
+    }
+
+    close(conn);
+    return 0;
+}
+
+// New process: connect to the old process at `path` and receive up to
+// `max_fds` listening sockets. On success returns the number of fds and
+// stores the connection in `*conn_out` for handover_ack(); -1 on failure.
+static int handover_receive(const char *path, int *fds, int max_fds, int *conn_out)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+    char tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int conn, n = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path) || max_fds > HANDOVER_MAX_FDS)
+        return -1;
+
+    if ((conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Handover socket creation failed");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Handover connect failed");
+        close(conn);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) <= 0 || tag != 'H') {
+        fprintf(stderr, "Handover: no sockets received\n");
+        close(conn);
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (n > max_fds)
+                n = max_fds;
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+            break;
+        }
+    }
+
+    if (n == 0) {
+        close(conn);
+        return -1;
+    }
+
+    *conn_out = conn;
+    return n;
+}
+
+// New process: tell the old process we are accepting, so it can drain
+static void handover_ack(int conn)
+{
+    char ack = 'A';
+    if (write(conn, &ack, 1) != 1)
+        perror("Handover ack failed");
+    close(conn);
+}
+
+#endif
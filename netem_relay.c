@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+// Userspace UDP relay that impairs traffic between two peers.
+//
+// Peer A sends to our listen port; we forward to the target (peer B) from a
+// second socket, and send B's replies back to A's last address. Both
+// directions get the same configurable delay, jitter, loss, reordering and
+// rate limit, optionally changed over time by a scenario file.
+
+#define DEFAULT_LISTEN_PORT 40000
+#define MAX_PACKET 65536
+#define DEFAULT_QUEUE_MS 200
+#define STATS_INTERVAL 5.0
+
+enum { DIR_A_TO_B = 0, DIR_B_TO_A = 1 };
+
+// Impairment parameters (both directions)
+struct impairment {
+    double delay_ms;
+    double jitter_ms;
+    double loss_pct;
+    double reorder_pct;
+    double rate_kbps;   // 0 = unlimited
+    double queue_ms;    // bottleneck buffer; packets beyond it are dropped
+};
+
+// One line of a scenario file: from `at` seconds on, use `params`
+struct scenario_step {
+    double at;
+    struct impairment params;
+};
+
+struct packet {
+    double due;
+    unsigned long seq;
+    int dir;
+    size_t len;
+    char data[];
+};
+
+struct link_state {
+    double next_free;   // when the rate-limited link finishes sending
+    double last_due;    // keeps packets in order unless reordering is chosen
+    unsigned long forwarded;
+    unsigned long lost;
+    unsigned long queue_drops;
+    unsigned long reordered;
+};
+
+// Min-heap of packets ordered by release time
+static struct packet **heap = NULL;
+static size_t heap_len = 0, heap_cap = 0;
+
+static struct impairment current = { 0, 0, 0, 0, 0, DEFAULT_QUEUE_MS };
+static struct link_state links[2];
+static volatile sig_atomic_t stop = 0;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int packet_before(const struct packet *a, const struct packet *b) {
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void heap_push(struct packet *p) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 256;
+        heap = realloc(heap, heap_cap * sizeof(*heap));
+        if (!heap) {
+            perror("Out of memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t i = heap_len++;
+    while (i > 0 && packet_before(p, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = p;
+}
+
+static struct packet *heap_pop(void) {
+    struct packet *top = heap[0];
+    struct packet *last = heap[--heap_len];
+    size_t i = 0;
+
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= heap_len)
+            break;
+        if (child + 1 < heap_len && packet_before(heap[child + 1], heap[child]))
+            child++;
+        if (!packet_before(heap[child], last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (heap_len > 0)
+        heap[i] = last;
+    return top;
+}
+
+static int chance(double pct) {
+    return pct > 0 && drand48() * 100.0 < pct;
+}
+
+// Apply the impairment to a received packet and queue it for release
+static void enqueue(int dir, const char *data, size_t len, double now) {
+    static unsigned long seq = 0;
+    struct link_state *link = &links[dir];
+
+    if (chance(current.loss_pct)) {
+        link->lost++;
+        return;
+    }
+
+    // Rate limit: the packet leaves the bottleneck once the link is free
+    double sent_at = now;
+    if (current.rate_kbps > 0) {
+        double start = link->next_free > now ? link->next_free : now;
+        if (start - now > current.queue_ms / 1000.0) {
+            link->queue_drops++;
+            return;
+        }
+        link->next_free = start + len * 8.0 / (current.rate_kbps * 1000.0);
+        sent_at = link->next_free;
+    }
+
+    double delay = current.delay_ms;
+    if (current.jitter_ms > 0)
+        delay += (drand48() * 2.0 - 1.0) * current.jitter_ms;
+    if (delay < 0)
+        delay = 0;
+
+    double due = sent_at + delay / 1000.0;
+    if (chance(current.reorder_pct)) {
+        // Hold this one back so the packets behind it overtake it
+        due += (current.jitter_ms + 10.0) / 1000.0;
+        link->reordered++;
+    } else if (due < link->last_due) {
+        due = link->last_due;
+    }
+    if (due > link->last_due)
+        link->last_due = due;
+
+    struct packet *p = malloc(sizeof(*p) + len);
+    if (!p) {
+        link->queue_drops++;
+        return;
+    }
+    p->due = due;
+    p->seq = seq++;
+    p->dir = dir;
+    p->len = len;
+    memcpy(p->data, data, len);
+    heap_push(p);
+}
+
+static int parse_step(char *line, struct scenario_step *step, const struct impairment *prev) {
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t\r\n", &save);
+
+    if (!tok || tok[0] == '#')
+        return 0;
+
+    step->at = atof(tok);
+    step->params = *prev;
+    while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+        char *eq = strchr(tok, '=');
+        if (!eq) {
+            fprintf(stderr, "Bad scenario token: %s\n", tok);
+            return -1;
+        }
+        *eq = '\0';
+        double v = atof(eq + 1);
+        if (!strcmp(tok, "delay")) step->params.delay_ms = v;
+        else if (!strcmp(tok, "jitter")) step->params.jitter_ms = v;
+        else if (!strcmp(tok, "loss")) step->params.loss_pct = v;
+        else if (!strcmp(tok, "reorder")) step->params.reorder_pct = v;
+        else if (!strcmp(tok, "rate")) step->params.rate_kbps = v;
+        else if (!strcmp(tok, "queue")) step->params.queue_ms = v;
+        else {
+            fprintf(stderr, "Unknown scenario key: %s\n", tok);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Scenario file: "<seconds> key=value ..." per line, keys are delay, jitter
+// (ms), loss, reorder (percent), rate (kbps) and queue (ms). Keys not given
+// keep their previous value.
+static struct scenario_step *load_scenario(const char *path, size_t *count) {
+    FILE *f = fopen(path, "r");
+    struct scenario_step *steps = NULL;
+    struct impairment prev = current;
+    char line[512];
+    size_t n = 0;
+
+    if (!f) {
+        perror("Failed to open scenario");
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct scenario_step step;
+        int rc = parse_step(line, &step, &prev);
+        if (rc < 0)
+            exit(EXIT_FAILURE);
+        if (rc == 0)
+            continue;
+        steps = realloc(steps, (n + 1) * sizeof(*steps));
+        steps[n++] = step;
+        prev = step.params;
+    }
+    fclose(f);
+    *count = n;
+    return steps;
+}
+
+static void print_params(double elapsed) {
+    printf("[Relay] t=%.1fs delay=%.0fms jitter=%.0fms loss=%.1f%% reorder=%.1f%% rate=%.0fkbps queue=%.0fms\n",
+           elapsed, current.delay_ms, current.jitter_ms, current.loss_pct,
+           current.reorder_pct, current.rate_kbps, current.queue_ms);
+}
+
+static void print_stats(void) {
+    static const char *names[2] = { "A->B", "B->A" };
+    for (int d = 0; d < 2; d++) {
+        printf("[Relay] %s forwarded=%lu lost=%lu queue_drops=%lu reordered=%lu\n",
+               names[d], links[d].forwarded, links[d].lost,
+               links[d].queue_drops, links[d].reordered);
+    }
+    fflush(stdout);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static int udp_socket(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -t target_host:port [-l listen_port] [-d delay_ms] [-j jitter_ms]\n"
+            "          [-p loss_pct] [-r reorder_pct] [-b rate_kbps] [-q queue_ms]\n"
+            "          [-s scenario_file] [-S seed]\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in target, peer_a;
+    socklen_t peer_a_len = 0;
+    int listen_port = DEFAULT_LISTEN_PORT;
+    const char *target_arg = NULL, *scenario_path = NULL;
+    struct scenario_step *steps = NULL;
+    size_t step_count = 0, next_step = 0;
+    long seed = 1;
+    char buffer[MAX_PACKET];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:l:d:j:p:r:b:q:s:S:h")) != -1) {
+        switch (opt) {
+        case 't': target_arg = optarg; break;
+        case 'l': listen_port = atoi(optarg); break;
+        case 'd': current.delay_ms = atof(optarg); break;
+        case 'j': current.jitter_ms = atof(optarg); break;
+        case 'p': current.loss_pct = atof(optarg); break;
+        case 'r': current.reorder_pct = atof(optarg); break;
+        case 'b': current.rate_kbps = atof(optarg); break;
+        case 'q': current.queue_ms = atof(optarg); break;
+        case 's': scenario_path = optarg; break;
+        case 'S': seed = atol(optarg); break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    // Resolve the target
+    char *colon = target_arg ? strrchr(target_arg, ':') : NULL;
+    if (!colon) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - target_arg), target_arg);
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM }, *res;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", target_arg);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&target, res->ai_addr, sizeof(target));
+    freeaddrinfo(res);
+
+    if (scenario_path)
+        steps = load_scenario(scenario_path, &step_count);
+
+    srand48(seed);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int front = udp_socket(listen_port);  // faces peer A
+    int back = udp_socket(0);             // faces peer B
+
+    printf("[Relay] Listening on UDP %d, forwarding to %s\n", listen_port, target_arg);
+
+    double start = now_seconds();
+    double next_stats = start + STATS_INTERVAL;
+    print_params(0);
+
+    while (!stop) {
+        double now = now_seconds();
+
+        // Advance the scenario
+        while (next_step < step_count && steps[next_step].at <= now - start) {
+            current = steps[next_step++].params;
+            print_params(now - start);
+        }
+
+        // Release everything that is due
+        while (heap_len > 0 && heap[0]->due <= now) {
+            struct packet *p = heap_pop();
+            if (p->dir == DIR_A_TO_B) {
+                sendto(back, p->data, p->len, 0, (struct sockaddr *)&target, sizeof(target));
+            } else if (peer_a_len > 0) {
+                sendto(front, p->data, p->len, 0, (struct sockaddr *)&peer_a, peer_a_len);
+            }
+            links[p->dir].forwarded++;
+            free(p);
+        }
+
+        if (now >= next_stats) {
+            print_stats();
+            next_stats += STATS_INTERVAL;
+        }
+
+        // Sleep until the next packet is due, a scenario step or stats
+        double wake = next_stats;
+        if (heap_len > 0 && heap[0]->due < wake)
+            wake = heap[0]->due;
+        if (next_step < step_count && start + steps[next_step].at < wake)
+            wake = start + steps[next_step].at;
+        int timeout = (int)((wake - now) * 1000.0);
+        if (timeout < 0)
+            timeout = 0;
+
+        struct pollfd pfds[2] = {
+            { .fd = front, .events = POLLIN },
+            { .fd = back, .events = POLLIN },
+        };
+        if (poll(pfds, 2, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Poll failed");
+            break;
+        }
+
+        now = now_seconds();
+        if (pfds[0].revents & POLLIN) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t n = recvfrom(front, buffer, sizeof(buffer), 0,
+                                 (struct sockaddr *)&from, &from_len);
+            if (n > 0) {
+                // Replies from B go to whoever last talked to us
+                peer_a = from;
+                peer_a_len = from_len;
+                enqueue(DIR_A_TO_B, buffer, n, now);
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            ssize_t n = recvfrom(back, buffer, sizeof(buffer), 0, NULL, NULL);
+            if (n > 0)
+                enqueue(DIR_B_TO_A, buffer, n, now);
+        }
+    }
+
+    print_stats();
+    close(front);
+    close(back);
+    free(steps);
+    return 0;
+}
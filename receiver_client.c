@@ -1,52 +1,322 @@
+#define _GNU_SOURCE
 #include <libwebsockets.h>
 #include <gst/gst.h>
 #include <gst/webrtc/webrtc.h>
+#include <gst/app/app.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include "trace.h"
+#include "candidates.h"
+#include "shm_ring.h"
 
-static GstElement *webrtc = NULL;
+// Local ICE candidates are collected for this long and sent as one message
+#define DEFAULT_BATCH_WINDOW_MS 20
+
+static struct lws_context *context = NULL;
+static struct lws *client_wsi = NULL;
+
+// Offers grow with codecs and simulcast layers; cap one assembled message
+#define MAX_MESSAGE_SIZE (1024 * 1024)
 
 struct per_session_data {
-    char message[4096];
-    size_t len;
+    GString *message;     // assembled from fragments, up to MAX_MESSAGE_SIZE
+};
+
+// Outgoing signaling messages, written from the lws service thread
+static GMutex outbox_lock;
+static GQueue outbox = G_QUEUE_INIT;
+static GString *candidate_batch = NULL;   // "<mlineindex> <candidate>\n" lines
+static gboolean candidates_done = FALSE;  // end-of-candidates still to send
+static gboolean batch_scheduled = FALSE;
+static int batch_window_ms = DEFAULT_BATCH_WINDOW_MS;
+static lws_sorted_usec_list_t batch_sul;
+
+// Headless mode renders into a clock-synced fakesink instead of a window
+static gboolean headless = FALSE;
+static volatile sig_atomic_t stop = 0;
+
+// Relay mode: media is forced through netem_relay. We bind ICE to a fixed
+// port, advertise only the relay's address and ignore the sender's
+// candidates, so the sender can only reach us through the relay. Only one
+// peer can hold the port, so no peers are pooled in this mode.
+#define DEFAULT_ICE_PORT 50000
+static gchar *relay_host = NULL;
+static int relay_port = 0;
+static int ice_port = DEFAULT_ICE_PORT;
+static gboolean relay_candidate_sent = FALSE;
+
+// Playback metrics, updated from the sink's streaming thread
+#define STATS_INTERVAL_MS 1000
+#define FREEZE_MIN_EXTRA_MS 150.0
+#define NTP_UNIX_OFFSET_S 2208988800ULL
+
+struct frame_stats {
+    GMutex lock;
+    guint64 frames;
+    guint64 interval_frames;
+    gint64 first_us;
+    gint64 last_us;
+    double avg_interval_ms;
+    guint freezes;
+    double freeze_ms;
+    GArray *latencies_ms;
+    // Data-channel benchmark: bulk bytes counted, probes echoed back
+    guint64 dc_bytes;
+    guint64 interval_dc_bytes;
+    guint64 dc_probes;
+};
+
+static struct frame_stats stats;
+static GstCaps *ntp_caps = NULL;
+static lws_sorted_usec_list_t stats_sul;
+
+// Recording: the depayloaded VP8 is also muxed, without re-encoding, into
+// WebM segments. The recording queue leaks, so a slow disk drops recorded
+// frames instead of stalling playback. Each segment file is preallocated
+// one rotation ahead, so filesystem allocation never happens on rotation.
+// splitmuxsink writes through an fdsink whose fd we open ourselves, without
+// O_APPEND or O_TRUNC, so the muxer can seek back and finalize each segment.
+#define DEFAULT_SEGMENT_S 10
+#define REC_QUEUE_MS 2000          // how far recording may lag before dropping
+#define REC_MAX_KBPS 2500          // sender's top bitrate, sizes preallocation
+#define REC_CLOSE_TIMEOUT_MS 2000
+
+static const char *record_dir = NULL;
+static int segment_s = DEFAULT_SEGMENT_S;
+
+// Simulcast layer to ask the sender for (-l), sent with every Answer
+static const char *wanted_layer = NULL;
+
+// Local mode: when the server advertises a sender ring on this host
+// (SERVER_SHM:), frames are read from shared memory instead of WebRTC, and
+// offers are ignored while the ring is in use. -N turns this off.
+#define SHM_WAIT_MS 100
+
+static gboolean use_shm = TRUE;
+static struct shm_ring shm;
+static int shm_efd = -1;
+static GstElement *shm_pipeline = NULL;
+static GThread *shm_thread = NULL;
+static gint shm_stop = 0;
+static gint shm_gone = 0;    // the publisher went away, offers are used again
+
+// A receive path: webrtcbin plus its decode/render bin. Pooled peers are
+// built and running before any offer arrives, so a session only has to
+// negotiate. webrtcbin gathers ICE candidates only once it has a local
+// description, so that part cannot be done ahead of time here; the sender
+// gathers while its WebSocket connects instead.
+#define DEFAULT_POOL_SIZE 1
+
+struct peer {
+    GstElement *pipeline;
+    GstElement *webrtc;
+    GstElement *decoder;      // held at READY until the stream appears
+    gboolean pooled;          // claimed from the pool, not built on demand
+    gboolean linked;
+    // Setup phases, in microseconds since the offer arrived (0 = not yet)
+    gint64 offer_us;
+    gint64 answer_us;
+    gint64 gathered_us;
+    gint64 ice_us;
+    gint64 connected_us;
+    gint64 first_frame_us;
+    // Recording (-r): segment files are <rec_prefix>-NNNNN.webm
+    GstPad *rec_pad;          // sink of the recording queue
+    gchar *rec_prefix;        // set when the first segment is opened
+    guint rec_next;           // segment preallocated for the next rotation
+    int rec_next_fd;
+    GMutex rec_lock;
+    GQueue rec_open;          // struct rec_segment, oldest first
+    gboolean rec_closing;     // final EOS sent
+    gint rec_closed;          // all segments closed after the final EOS
+    gint64 close_deadline;
 };
 
+// A segment splitmuxsink is writing, until its fragment-closed message
+struct rec_segment {
+    int fd;
+    gchar *path;
+};
+
+// Peers whose last segment is still being finalized. They are freed on the
+// lws thread once it is closed, or after REC_CLOSE_TIMEOUT_MS.
+static GQueue retiring = G_QUEUE_INIT;
+static lws_sorted_usec_list_t retire_sul;
+static gint recordings_closed = 0;   // set from the bus sync handler
+static gint rec_sessions = 0;
+
+static GQueue pool = G_QUEUE_INIT;   // warmed, unclaimed peers
+static int pool_size = DEFAULT_POOL_SIZE;
+static struct peer *active = NULL;   // peer of the current session
+static lws_sorted_usec_list_t pool_sul;
+
 // Forward declaration
 static void on_answer_created(GstPromise *promise, gpointer user_data);
 
+/* Queue a message for the server (takes ownership of msg) */
+static void queue_message(gchar *msg)
+{
+    g_mutex_lock(&outbox_lock);
+    g_queue_push_tail(&outbox, msg);
+    g_mutex_unlock(&outbox_lock);
+    lws_cancel_service(context);
+}
+
+/* Batch window elapsed: turn the collected candidates into one message */
+static void flush_candidate_batch(lws_sorted_usec_list_t *sul)
+{
+    g_mutex_lock(&outbox_lock);
+    if (candidate_batch->len > 0) {
+        g_queue_push_tail(&outbox, g_strdup_printf(CANDIDATES_PREFIX "%s", candidate_batch->str));
+        g_string_truncate(candidate_batch, 0);
+    }
+    if (candidates_done) {
+        g_queue_push_tail(&outbox, g_strdup("end-of-candidates"));
+        candidates_done = FALSE;
+    }
+    batch_scheduled = FALSE;
+    g_mutex_unlock(&outbox_lock);
+
+    lws_callback_on_writable(client_wsi);
+}
+
+/* Rewrite our fixed-port host candidate to point at the relay instead.
+ * Returns NULL for candidates that must not be advertised. */
+static gchar *relay_candidate(const gchar *candidate)
+{
+    // candidate:<foundation> <component> <transport> <priority> <addr> <port> typ <type>
+    gchar **f = g_strsplit(candidate, " ", -1);
+    gchar *out = NULL;
+
+    if (!relay_candidate_sent && g_strv_length(f) >= 8 &&
+        !strcmp(f[1], "1") && !g_ascii_strcasecmp(f[2], "UDP") &&
+        atoi(f[5]) == ice_port && !strcmp(f[7], "host")) {
+        g_free(f[4]);
+        f[4] = g_strdup(relay_host);
+        g_free(f[5]);
+        f[5] = g_strdup_printf("%d", relay_port);
+        out = g_strjoinv(" ", f);
+        relay_candidate_sent = TRUE;
+    }
+    g_strfreev(f);
+    return out;
+}
+
 /* Called when GStreamer has a local ICE candidate to send */
 static void on_ice_candidate(GstElement *webrtcbin, guint mlineindex,
                              gchar *candidate, gpointer user_data)
 {
-    struct lws *wsi = (struct lws *)user_data;
+    if (user_data != active)
+        return;
+
     lwsl_user("[Receiver] Local ICE candidate:\n%s\n", candidate);
 
-    gchar *msg = g_strdup_printf("candidate:%s", candidate);
-    unsigned char *buf = malloc(LWS_PRE + strlen(msg) + 1);
-    memset(buf, 0, LWS_PRE + strlen(msg) + 1);
-    memcpy(&buf[LWS_PRE], msg, strlen(msg));
+    gchar *relayed = NULL;
+    if (relay_host) {
+        if (!(relayed = relay_candidate(candidate)))
+            return;
+        lwsl_user("[Receiver] Advertising relay candidate:\n%s\n", relayed);
+        candidate = relayed;
+    }
+
+    g_mutex_lock(&outbox_lock);
+    candidates_batch_add(candidate_batch, &outbox, "", mlineindex, candidate);
+    g_mutex_unlock(&outbox_lock);
+    lws_cancel_service(context);
+    g_free(relayed);
+}
+
+/* Record the first time a setup phase is reached */
+static void mark_phase(struct peer *p, gint64 *phase, const char *name)
+{
+    if (*phase || !p->offer_us)
+        return;
+    *phase = g_get_monotonic_time() - p->offer_us;
+    lwsl_user("[Receiver] PHASE %s +%.1f ms\n", name, *phase / 1000.0);
+    trace_event(name, "setup", p->offer_us, *phase);
+}
 
-    if (lws_write(wsi, &buf[LWS_PRE], strlen(msg), LWS_WRITE_TEXT) < 0) {
-        lwsl_err("[Receiver] Failed to send ICE candidate\n");
+/* One line per session, once the first frame has been rendered */
+static void print_setup(struct peer *p)
+{
+    printf("[Receiver] SETUP pool=%s answer_ms=%.1f gathered_ms=%.1f ice_ms=%.1f "
+           "connected_ms=%.1f first_frame_ms=%.1f\n",
+           p->pooled ? "hit" : "miss", p->answer_us / 1000.0, p->gathered_us / 1000.0,
+           p->ice_us / 1000.0, p->connected_us / 1000.0, p->first_frame_us / 1000.0);
+    fflush(stdout);
+}
+
+/* Gathering finished: tell the peer no more candidates will follow */
+static void on_ice_gathering_state(GstElement *webrtcbin, GParamSpec *pspec,
+                                   gpointer user_data)
+{
+    struct peer *p = user_data;
+    GstWebRTCICEGatheringState state;
+    g_object_get(webrtcbin, "ice-gathering-state", &state, NULL);
+
+    if (state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE && p == active) {
+        mark_phase(p, &p->gathered_us, "ice_gathered");
+        if (relay_host && !relay_candidate_sent)
+            lwsl_err("[Receiver] No ICE candidate on port %d, the relay cannot reach "
+                     "this session\n", ice_port);
+        g_mutex_lock(&outbox_lock);
+        candidates_done = TRUE;
+        g_mutex_unlock(&outbox_lock);
+        lws_cancel_service(context);
     }
+}
+
+static void on_ice_connection_state(GstElement *webrtcbin, GParamSpec *pspec,
+                                    gpointer user_data)
+{
+    struct peer *p = user_data;
+    GstWebRTCICEConnectionState state;
+    g_object_get(webrtcbin, "ice-connection-state", &state, NULL);
 
-    free(buf);
-    g_free(msg);
+    if (state == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED ||
+        state == GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED)
+        mark_phase(p, &p->ice_us, "ice_connected");
+}
+
+/* Connected means ICE and the DTLS handshake have both finished */
+static void on_connection_state(GstElement *webrtcbin, GParamSpec *pspec,
+                                gpointer user_data)
+{
+    struct peer *p = user_data;
+    GstWebRTCPeerConnectionState state;
+    g_object_get(webrtcbin, "connection-state", &state, NULL);
+
+    if (state == GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED)
+        mark_phase(p, &p->connected_us, "dtls_connected");
 }
 
 /* Add a remote ICE candidate on the receiver side */
-static void handle_remote_candidate(const char *candidate_sdp)
+static void handle_remote_candidate(unsigned mlineindex, const char *candidate_sdp, void *user)
 {
+    if (relay_host) {
+        // The sender must reach us through the relay, never directly
+        lwsl_user("[Receiver] Ignoring remote ICE candidate (relay mode)\n");
+        return;
+    }
+    if (!active) {
+        lwsl_user("[Receiver] Ignoring remote ICE candidate (no offer yet)\n");
+        return;
+    }
     lwsl_user("[Receiver] Adding remote ICE candidate:\n%s\n", candidate_sdp);
-    // Typically parse out mline index, but let's assume 0
-    g_signal_emit_by_name(webrtc, "add-ice-candidate", 0, candidate_sdp);
+    g_signal_emit_by_name(active->webrtc, "add-ice-candidate", mlineindex, candidate_sdp);
 }
 
 /* Called after we create an Answer in GStreamer */
 static void on_answer_created(GstPromise *promise, gpointer user_data)
 {
-    struct lws *wsi = (struct lws *)user_data;
+    struct peer *p = user_data;
     gst_promise_wait(promise);
 
     const GstStructure *reply = gst_promise_get_reply(promise);
@@ -58,8 +328,10 @@ static void on_answer_created(GstPromise *promise, gpointer user_data)
         return;
     }
 
-    // Set local desc
-    g_signal_emit_by_name(webrtc, "set-local-description", answer, NULL);
+    // Set local desc; this starts ICE gathering
+    g_signal_emit_by_name(p->webrtc, "set-local-description", answer, NULL);
+    mark_phase(p, &p->answer_us, "answer_created");
+    TRACE_SPAN(create_answer, "signaling", p->offer_us);
 
     gchar *sdp_text = gst_sdp_message_as_text(answer->sdp);
     gst_webrtc_session_description_free(answer);
@@ -73,18 +345,664 @@ static void on_answer_created(GstPromise *promise, gpointer user_data)
     lwsl_user("[Receiver] Created SDP Answer:\n%s\n", sdp_text);
 
     // Send "answer:..." back to server
-    unsigned char *buf = malloc(LWS_PRE + strlen(sdp_text) + 8);
-    memset(buf, 0, LWS_PRE + strlen(sdp_text) + 8);
-    snprintf((char*)&buf[LWS_PRE], strlen(sdp_text) + 8, "answer:%s", sdp_text);
+    queue_message(g_strdup_printf("answer:%s", sdp_text));
+    lwsl_user("[Receiver] Queued SDP Answer for server\n");
+
+    if (wanted_layer)
+        queue_message(g_strdup_printf("select-layer:%s", wanted_layer));
 
-    if (lws_write(wsi, &buf[LWS_PRE], strlen((char*)&buf[LWS_PRE]), LWS_WRITE_TEXT) < 0) {
-        lwsl_err("[Receiver] Failed to send SDP Answer\n");
+    g_free(sdp_text);
+}
+
+/* Called for every frame reaching the video sink */
+static GstPadProbeReturn on_frame(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    struct peer *p = user_data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    gint64 now = g_get_monotonic_time();
+
+    if (p && !p->first_frame_us && p->offer_us) {
+        mark_phase(p, &p->first_frame_us, "first_frame");
+        print_setup(p);
+    }
+
+    // Capture time (sender NTP clock) attached by rtpbin from RTCP SRs;
+    // meaningful when sender and receiver share a host clock
+    GstReferenceTimestampMeta *meta =
+        gst_buffer_get_reference_timestamp_meta(buf, ntp_caps);
+    double latency_ms = -1;
+    if (meta) {
+        guint64 now_ntp = (guint64)g_get_real_time() * 1000 + NTP_UNIX_OFFSET_S * GST_SECOND;
+        latency_ms = ((gint64)(now_ntp - meta->timestamp)) / 1e6;
+    }
+
+    g_mutex_lock(&stats.lock);
+    if (stats.frames == 0) {
+        stats.first_us = now;
     } else {
-        lwsl_user("[Receiver] Sent SDP Answer to server\n");
+        double gap_ms = (now - stats.last_us) / 1000.0;
+
+        // Same freeze definition as WebRTC's freezeCount
+        if (stats.avg_interval_ms > 0 &&
+            gap_ms > MAX(3 * stats.avg_interval_ms, stats.avg_interval_ms + FREEZE_MIN_EXTRA_MS)) {
+            stats.freezes++;
+            stats.freeze_ms += gap_ms;
+        }
+        stats.avg_interval_ms = stats.avg_interval_ms > 0 ?
+            0.9 * stats.avg_interval_ms + 0.1 * gap_ms : gap_ms;
     }
+    stats.last_us = now;
+    stats.frames++;
+    stats.interval_frames++;
+    if (latency_ms >= 0)
+        g_array_append_val(stats.latencies_ms, latency_ms);
+    g_mutex_unlock(&stats.lock);
 
-    free(buf);
-    g_free(sdp_text);
+    return GST_PAD_PROBE_OK;
+}
+
+static int compare_doubles(gconstpointer a, gconstpointer b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Periodic one-line report (headless mode) */
+static void print_stats(lws_sorted_usec_list_t *sul)
+{
+    g_mutex_lock(&stats.lock);
+    double latency = stats.latencies_ms->len ?
+        g_array_index(stats.latencies_ms, double, stats.latencies_ms->len - 1) : -1;
+    lwsl_user("[Receiver] STATS fps=%.1f freezes=%u latency_ms=%.1f\n",
+              stats.interval_frames * 1000.0 / STATS_INTERVAL_MS, stats.freezes, latency);
+    stats.interval_frames = 0;
+    if (stats.dc_bytes > 0)
+        lwsl_user("[Receiver] DATA bulk_mbps=%.1f probes_echoed=%" G_GUINT64_FORMAT "\n",
+                  stats.interval_dc_bytes * 8.0 / (STATS_INTERVAL_MS * 1000), stats.dc_probes);
+    stats.interval_dc_bytes = 0;
+    g_mutex_unlock(&stats.lock);
+
+    lws_sul_schedule(context, 0, &stats_sul, print_stats, STATS_INTERVAL_MS * LWS_US_PER_MS);
+}
+
+/* Final machine-readable summary, parsed by scripts/impairment_test.sh */
+static void print_summary(void)
+{
+    g_mutex_lock(&stats.lock);
+    double duration = stats.frames > 1 ? (stats.last_us - stats.first_us) / 1e6 : 0;
+    double avg = 0, p95 = 0;
+    guint n = stats.latencies_ms->len;
+
+    if (n > 0) {
+        g_array_sort(stats.latencies_ms, compare_doubles);
+        for (guint i = 0; i < n; i++)
+            avg += g_array_index(stats.latencies_ms, double, i);
+        avg /= n;
+        p95 = g_array_index(stats.latencies_ms, double, (guint)(0.95 * (n - 1)));
+    }
+
+    printf("[Receiver] SUMMARY frames=%" G_GUINT64_FORMAT " duration_s=%.1f avg_fps=%.1f "
+           "freezes=%u freeze_ms=%.0f latency_avg_ms=%.1f latency_p95_ms=%.1f\n",
+           stats.frames, duration, duration > 0 ? stats.frames / duration : 0,
+           stats.freezes, stats.freeze_ms, avg, p95);
+    fflush(stdout);
+    g_mutex_unlock(&stats.lock);
+}
+
+static void on_signal(int sig)
+{
+    stop = 1;
+    lws_cancel_service(context);
+}
+
+static void on_bulk_data(GstWebRTCDataChannel *channel, GBytes *data, gpointer user_data)
+{
+    g_mutex_lock(&stats.lock);
+    stats.dc_bytes += g_bytes_get_size(data);
+    stats.interval_dc_bytes += g_bytes_get_size(data);
+    g_mutex_unlock(&stats.lock);
+}
+
+/* Probes go straight back so the sender can measure round-trip time */
+static void on_probe_data(GstWebRTCDataChannel *channel, GBytes *data, gpointer user_data)
+{
+    g_signal_emit_by_name(channel, "send-data", data);
+    g_mutex_lock(&stats.lock);
+    stats.dc_probes++;
+    g_mutex_unlock(&stats.lock);
+}
+
+/* The sender opened a data channel (see its -D benchmark) */
+static void on_data_channel(GstElement *webrtcbin, GstWebRTCDataChannel *channel,
+                            gpointer user_data)
+{
+    gchar *label = NULL;
+    g_object_get(channel, "label", &label, NULL);
+    lwsl_user("[Receiver] Data channel \"%s\" opened by peer\n", label);
+
+    if (!g_strcmp0(label, "bench-bulk"))
+        g_signal_connect(channel, "on-message-data", G_CALLBACK(on_bulk_data), NULL);
+    else if (!g_strcmp0(label, "bench-probe"))
+        g_signal_connect(channel, "on-message-data", G_CALLBACK(on_probe_data), NULL);
+    g_free(label);
+}
+
+/* webrtcbin exposed a stream: hand it to the prebuilt decode bin. A
+ * simulcast layer switch arrives as a new SSRC and may get a pad of its
+ * own, so every stream joins the decode bin's funnel; only the selected
+ * layer carries packets. */
+static void on_incoming_stream(GstElement *webrtcbin, GstPad *pad, gpointer user_data)
+{
+    struct peer *p = user_data;
+
+    if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC)
+        return;
+
+    GstElement *in = gst_bin_get_by_name(GST_BIN(p->decoder), "in");
+    GstPad *target = gst_element_request_pad_simple(in, "sink_%u");
+    GstPad *sinkpad = gst_ghost_pad_new(NULL, target);
+    gst_pad_set_active(sinkpad, TRUE);
+    gst_element_add_pad(p->decoder, sinkpad);
+    if (gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK)
+        lwsl_err("[Receiver] Failed to link incoming stream\n");
+    gst_object_unref(target);
+    gst_object_unref(in);
+
+    if (!p->linked) {
+        gst_element_set_locked_state(p->decoder, FALSE);
+        gst_element_sync_state_with_parent(p->decoder);
+        p->linked = TRUE;
+    }
+
+    lwsl_user("[Receiver] Incoming stream linked%s\n", headless ? " (headless)" : "");
+}
+
+static gchar *segment_path(struct peer *p, guint fragment)
+{
+    return g_strdup_printf("%s-%05u.webm", p->rec_prefix, fragment);
+}
+
+/* Create a segment file and reserve disk space for it without changing its
+ * size, so the muxer's writes land in already-allocated blocks. Returns the
+ * open fd, or -1. */
+static int preallocate_segment(struct peer *p, guint fragment)
+{
+    static gboolean warned = FALSE;
+    gchar *path = segment_path(p, fragment);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        lwsl_err("[Receiver] Cannot create %s\n", path);
+    } else {
+        off_t size = (off_t)segment_s * REC_MAX_KBPS * 1000 / 8;
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 && !warned) {
+            lwsl_warn("[Receiver] Filesystem cannot preallocate segments\n");
+            warned = TRUE;
+        }
+    }
+    g_free(path);
+    return fd;
+}
+
+/* splitmuxsink starts the next segment: point its fdsink at the file
+ * preallocated on the previous rotation and preallocate the one after */
+static gchar *on_format_location(GstElement *splitmux, guint fragment, gpointer user_data)
+{
+    struct peer *p = user_data;
+    struct rec_segment *seg = g_new0(struct rec_segment, 1);
+    GstElement *sink = NULL;
+
+    if (!p->rec_prefix) {
+        // Unique per session, also when several start within one second
+        GDateTime *now = g_date_time_new_now_local();
+        gchar *stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+        p->rec_prefix = g_strdup_printf("%s/rec-%s-%d-%d", record_dir, stamp, (int)getpid(),
+                                        g_atomic_int_add(&rec_sessions, 1));
+        g_free(stamp);
+        g_date_time_unref(now);
+        p->rec_next_fd = preallocate_segment(p, fragment);
+    }
+    seg->fd = p->rec_next_fd;
+    seg->path = segment_path(p, fragment);
+    p->rec_next_fd = preallocate_segment(p, fragment + 1);
+    p->rec_next = fragment + 1;
+
+    if (seg->fd < 0) {
+        lwsl_err("[Receiver] Segment %s is lost\n", seg->path);
+        seg->fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+    g_object_get(splitmux, "sink", &sink, NULL);
+    g_object_set(sink, "fd", seg->fd, NULL);
+    gst_object_unref(sink);
+
+    g_mutex_lock(&p->rec_lock);
+    g_queue_push_tail(&p->rec_open, seg);
+    g_mutex_unlock(&p->rec_lock);
+
+    lwsl_user("[Receiver] Recording to %s\n", seg->path);
+    return NULL;   // fdsink has no location; its fd is set instead
+}
+
+/* Trim a closed segment to what was written and close it */
+static void close_segment(struct rec_segment *seg)
+{
+    struct stat st;
+    if (fstat(seg->fd, &st) == 0 && ftruncate(seg->fd, st.st_size) < 0)
+        lwsl_warn("[Receiver] Could not trim %s\n", seg->path);
+    close(seg->fd);
+    g_free(seg->path);
+    g_free(seg);
+}
+
+/* Segments are closed in order; once the last one after the final EOS is,
+ * wake the lws thread to free the peer */
+static GstBusSyncReply on_bus_sync(GstBus *bus, GstMessage *msg, gpointer user_data)
+{
+    struct peer *p = user_data;
+    const GstStructure *s = gst_message_get_structure(msg);
+
+    if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_ELEMENT ||
+        !gst_structure_has_name(s, "splitmuxsink-fragment-closed"))
+        return GST_BUS_PASS;
+
+    g_mutex_lock(&p->rec_lock);
+    struct rec_segment *seg = g_queue_pop_head(&p->rec_open);
+    gboolean done = p->rec_closing && g_queue_is_empty(&p->rec_open);
+    g_mutex_unlock(&p->rec_lock);
+
+    if (seg)
+        close_segment(seg);
+    if (done) {
+        g_atomic_int_set(&p->rec_closed, 1);
+        g_atomic_int_set(&recordings_closed, 1);
+        lws_cancel_service(context);
+    }
+
+    gst_message_unref(msg);
+    return GST_BUS_DROP;
+}
+
+static void setup_recording(struct peer *p)
+{
+    GstElement *recorder = gst_bin_get_by_name(GST_BIN(p->decoder), "recorder");
+    GstElement *queue = gst_bin_get_by_name(GST_BIN(p->decoder), "recqueue");
+
+    // fdsink on files we open ourselves (see on_format_location): filesink
+    // can only truncate or append, and with O_APPEND the muxer's header
+    // rewrites at the end of a segment would land at EOF
+    GstElement *fdsink = gst_element_factory_make("fdsink", NULL);
+    g_object_set(recorder, "sink", fdsink, NULL);
+    g_signal_connect(recorder, "format-location", G_CALLBACK(on_format_location), p);
+
+    GstBus *bus = gst_element_get_bus(p->pipeline);
+    gst_bus_set_sync_handler(bus, on_bus_sync, p, NULL);
+    gst_object_unref(bus);
+
+    p->rec_pad = gst_element_get_static_pad(queue, "sink");
+    gst_object_unref(queue);
+    gst_object_unref(recorder);
+}
+
+/* Drop the unused preallocated segment, and close any segment the muxer
+ * did not finish in time */
+static void finish_recording(struct peer *p)
+{
+    struct rec_segment *seg;
+
+    if (!g_atomic_int_get(&p->rec_closed))
+        lwsl_warn("[Receiver] Last segment was not closed in time\n");
+    while ((seg = g_queue_pop_head(&p->rec_open)))
+        close_segment(seg);
+
+    if (p->rec_next_fd >= 0)
+        close(p->rec_next_fd);
+    gchar *unused = segment_path(p, p->rec_next);
+    unlink(unused);
+    g_free(unused);
+}
+
+/* Build a receive path and start it, so that element creation, plugin
+ * loading and opening the video sink are already done when an offer comes */
+static struct peer *peer_new(void)
+{
+    struct peer *p = g_new0(struct peer, 1);
+    GError *error = NULL;
+
+    g_mutex_init(&p->rec_lock);
+    g_queue_init(&p->rec_open);
+    p->rec_next_fd = -1;
+
+    // GStreamer pipeline: webrtcbin plus a decode chain for its stream
+    p->pipeline = gst_parse_launch(
+    "webrtcbin name=webrtcbin "
+    // no stun-server
+    ,
+    NULL
+    );
+    if (!p->pipeline) {
+        lwsl_err("[Receiver] Failed to create pipeline\n");
+        g_free(p);
+        return NULL;
+    }
+    p->webrtc = gst_bin_get_by_name(GST_BIN(p->pipeline), "webrtcbin");
+
+    const char *render = headless ? "fakesink name=videosink sync=true"
+                                  : "autovideosink name=videosink";
+    gchar *description = record_dir ?
+        g_strdup_printf("funnel name=in ! queue ! rtpvp8depay ! tee name=rectee ! queue ! vp8dec ! videoconvert ! %s "
+                        "rectee. ! queue name=recqueue leaky=downstream max-size-buffers=0 "
+                        "max-size-bytes=0 max-size-time=%" G_GUINT64_FORMAT " ! "
+                        "splitmuxsink name=recorder muxer-factory=webmmux "
+                        "max-size-time=%" G_GUINT64_FORMAT,
+                        render, (guint64)REC_QUEUE_MS * GST_MSECOND,
+                        (guint64)segment_s * GST_SECOND) :
+        g_strdup_printf("funnel name=in ! queue ! rtpvp8depay ! vp8dec ! videoconvert ! %s", render);
+    p->decoder = gst_parse_bin_from_description(description, TRUE, &error);
+    g_free(description);
+    if (!p->decoder) {
+        lwsl_err("[Receiver] Failed to create decode bin: %s\n", error->message);
+        g_error_free(error);
+        gst_object_unref(p->webrtc);
+        gst_object_unref(p->pipeline);
+        g_free(p);
+        return NULL;
+    }
+    gst_bin_add(GST_BIN(p->pipeline), p->decoder);
+    gst_element_set_locked_state(p->decoder, TRUE);
+    gst_element_set_state(p->decoder, GST_STATE_READY);
+
+    GstElement *videosink = gst_bin_get_by_name(GST_BIN(p->decoder), "videosink");
+    GstPad *sinkpad = gst_element_get_static_pad(videosink, "sink");
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, on_frame, p, NULL);
+    gst_object_unref(sinkpad);
+    gst_object_unref(videosink);
+
+    if (record_dir)
+        setup_recording(p);
+
+    // Attach sender capture times to buffers, for latency measurement
+    GstElement *rtpbin = gst_bin_get_by_name(GST_BIN(p->webrtc), "rtpbin");
+    if (rtpbin) {
+        if (g_object_class_find_property(G_OBJECT_GET_CLASS(rtpbin),
+                                         "add-reference-timestamp-meta"))
+            g_object_set(rtpbin, "add-reference-timestamp-meta", TRUE, NULL);
+        gst_object_unref(rtpbin);
+    }
+
+    if (relay_host) {
+        GstWebRTCICE *ice = NULL;
+        g_object_get(p->webrtc, "ice-agent", &ice, NULL);
+        g_object_set(ice, "min-rtp-port", ice_port, "max-rtp-port", ice_port, NULL);
+        gst_object_unref(ice);
+    }
+
+    g_signal_connect(p->webrtc, "on-ice-candidate", G_CALLBACK(on_ice_candidate), p);
+    g_signal_connect(p->webrtc, "notify::ice-gathering-state",
+                     G_CALLBACK(on_ice_gathering_state), p);
+    g_signal_connect(p->webrtc, "notify::ice-connection-state",
+                     G_CALLBACK(on_ice_connection_state), p);
+    g_signal_connect(p->webrtc, "notify::connection-state",
+                     G_CALLBACK(on_connection_state), p);
+    g_signal_connect(p->webrtc, "pad-added", G_CALLBACK(on_incoming_stream), p);
+    g_signal_connect(p->webrtc, "on-data-channel", G_CALLBACK(on_data_channel), p);
+
+    gst_element_set_state(p->pipeline, GST_STATE_PLAYING);
+    return p;
+}
+
+static void peer_destroy(struct peer *p)
+{
+    gst_element_set_state(p->pipeline, GST_STATE_NULL);
+    if (p->rec_prefix)
+        finish_recording(p);
+    if (p->rec_pad)
+        gst_object_unref(p->rec_pad);
+    g_free(p->rec_prefix);
+    g_mutex_clear(&p->rec_lock);
+    gst_object_unref(p->webrtc);
+    gst_object_unref(p->pipeline);
+    g_free(p);
+}
+
+/* Free retiring peers whose recording is finalized or out of time */
+static void reap_retiring(lws_sorted_usec_list_t *sul)
+{
+    gint64 now = g_get_monotonic_time(), next = 0;
+    GList *l = retiring.head;
+
+    while (l) {
+        GList *n = l->next;
+        struct peer *p = l->data;
+        if (g_atomic_int_get(&p->rec_closed) || now >= p->close_deadline) {
+            g_queue_delete_link(&retiring, l);
+            peer_destroy(p);
+        } else if (!next || p->close_deadline < next) {
+            next = p->close_deadline;
+        }
+        l = n;
+    }
+    if (next)
+        lws_sul_schedule(context, 0, &retire_sul, reap_retiring, next - now);
+}
+
+/* Free a peer. A recording peer first ends its open segment properly
+ * (cues, duration); the lws thread does not wait for that here. */
+static void peer_free(struct peer *p)
+{
+    if (!p->rec_prefix) {
+        peer_destroy(p);
+        return;
+    }
+
+    g_mutex_lock(&p->rec_lock);
+    p->rec_closing = TRUE;
+    if (g_queue_is_empty(&p->rec_open))
+        g_atomic_int_set(&p->rec_closed, 1);
+    g_mutex_unlock(&p->rec_lock);
+
+    p->close_deadline = g_get_monotonic_time() + REC_CLOSE_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND;
+    gst_pad_send_event(p->rec_pad, gst_event_new_eos());
+    g_queue_push_tail(&retiring, p);
+    lws_sul_schedule(context, 0, &retire_sul, reap_retiring, 0);
+}
+
+/* Top the pool up, one peer per call so signaling is never held up long */
+static void refill_pool(lws_sorted_usec_list_t *sul)
+{
+    if ((int)g_queue_get_length(&pool) >= pool_size)
+        return;
+
+    gint64 start = g_get_monotonic_time();
+    struct peer *p = peer_new();
+    if (!p)
+        return;
+    p->pooled = TRUE;
+    g_queue_push_tail(&pool, p);
+    lwsl_user("[Receiver] Warmed pooled peer in %.1f ms (%u/%d)\n",
+              (g_get_monotonic_time() - start) / 1000.0, g_queue_get_length(&pool), pool_size);
+
+    if ((int)g_queue_get_length(&pool) < pool_size)
+        lws_sul_schedule(context, 0, &pool_sul, refill_pool, 0);
+}
+
+/* Relay mode: every session binds ICE to ice_port. Say so loudly if
+ * something holds it, such as a previous session still closing its
+ * recording, since the new session cannot gather a candidate then. */
+static void check_ice_port(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(ice_port) };
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno == EADDRINUSE)
+        lwsl_err("[Receiver] ICE port %d is in use%s\n", ice_port,
+                 g_queue_is_empty(&retiring) ? "" :
+                     " (a previous session is still closing its recording)");
+    close(fd);
+}
+
+/* A new offer starts a new session: take a warmed peer if there is one */
+static struct peer *claim_peer(void)
+{
+    struct peer *p = g_queue_pop_head(&pool);
+    if (!p)
+        p = peer_new();
+    if (p && pool_size > 0)
+        lws_sul_schedule(context, 0, &pool_sul, refill_pool, 0);
+    return p;
+}
+
+/* GStreamer's DTLS elements share one self-signed certificate per process,
+ * generated when the first one is created. Do that now rather than while
+ * the first offer is being answered. */
+static void pregenerate_certificate(void)
+{
+    gint64 start = g_get_monotonic_time();
+    GstElement *dtls = gst_element_factory_make("dtlsdec", NULL);
+    if (!dtls) {
+        lwsl_warn("[Receiver] dtlsdec not available, certificate not pregenerated\n");
+        return;
+    }
+    gst_object_unref(gst_object_ref_sink(dtls));
+    lwsl_user("[Receiver] DTLS certificate ready in %.1f ms\n",
+              (g_get_monotonic_time() - start) / 1000.0);
+}
+
+/* Push ring frames into the local pipeline. Raw frames are independent, so
+ * only the newest is shown; VP8 frames depend on the ones before, so all are
+ * pushed in order and a lost frame means waiting for the next keyframe. */
+static gpointer shm_reader(gpointer user_data)
+{
+    GstAppSrc *src = user_data;
+    gboolean vp8 = !strcmp(shm.hdr->format, "VP8");
+    gboolean need_keyframe = TRUE;
+    guint width = 0, height = 0;
+    uint64_t cursor = shm_ring_head(&shm);
+
+    while (!g_atomic_int_get(&shm_stop)) {
+        int r = shm_ring_wait(&shm, shm_efd, SHM_WAIT_MS);
+        if (r < 0) {
+            lwsl_user("[Receiver] Shared-memory publisher went away\n");
+            g_atomic_int_set(&shm_gone, 1);
+            break;
+        }
+
+        uint64_t head = shm_ring_head(&shm);
+        for (uint64_t seq = vp8 ? cursor + 1 : head; r > 0 && seq > cursor && seq <= head; seq++) {
+            const struct shm_ring_slot *slot = shm_ring_get(&shm, seq);
+            GstBuffer *buf = NULL;
+            gboolean keyframe = FALSE;
+
+            if (slot && slot->len > 0 && slot->len <= shm.hdr->slot_size) {
+                const guint8 *data = shm_ring_data(slot);
+                keyframe = !(data[0] & 1);
+                buf = gst_buffer_new_memdup(data, slot->len);
+                if (slot->width != width || slot->height != height) {
+                    width = slot->width;
+                    height = slot->height;
+                    GstCaps *caps = vp8 ?
+                        gst_caps_new_simple("video/x-vp8", "width", G_TYPE_INT, width,
+                                            "height", G_TYPE_INT, height, NULL) :
+                        gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "I420",
+                                            "width", G_TYPE_INT, width, "height", G_TYPE_INT, height,
+                                            "framerate", GST_TYPE_FRACTION, 0, 1, NULL);
+                    gst_app_src_set_caps(src, caps);
+                    gst_caps_unref(caps);
+                }
+                if (!shm_ring_still_valid(slot, seq))
+                    gst_clear_buffer(&buf);
+            }
+            if (!buf) {
+                need_keyframe = TRUE;   // overwritten before we got to it
+                continue;
+            }
+            if (vp8 && need_keyframe && !keyframe) {
+                gst_buffer_unref(buf);
+                continue;
+            }
+            need_keyframe = FALSE;
+            if (gst_app_src_push_buffer(src, buf) != GST_FLOW_OK)
+                break;
+        }
+        if (r > 0)
+            cursor = head;
+    }
+    return NULL;
+}
+
+static void shm_detach(void)
+{
+    if (!shm_pipeline)
+        return;
+    g_atomic_int_set(&shm_stop, 1);
+    g_thread_join(shm_thread);
+    shm_thread = NULL;
+    gst_element_set_state(shm_pipeline, GST_STATE_NULL);
+    gst_clear_object(&shm_pipeline);
+    close(shm_efd);
+    shm_efd = -1;
+    shm_ring_destroy(&shm);
+}
+
+/* The server advertised a sender ring: if it is on this host, play from it
+ * and drop the WebRTC session */
+static void shm_attach(const char *endpoint)
+{
+    char host_id[128], their_host[128], path[108];
+    GError *error = NULL;
+
+    shm_ring_host_id(host_id, sizeof(host_id));
+    if (sscanf(endpoint, "%127s %107s", their_host, path) != 2) {
+        lwsl_err("[Receiver] Malformed shared-memory endpoint: %s\n", endpoint);
+        return;
+    }
+    if (strcmp(their_host, host_id)) {
+        lwsl_user("[Receiver] Shared-memory endpoint is on another host, using WebRTC\n");
+        return;
+    }
+
+    shm_detach();
+    if ((shm_efd = shm_ring_attach(&shm, path)) < 0) {
+        lwsl_err("[Receiver] Cannot attach to %s, using WebRTC\n", path);
+        return;
+    }
+
+    const char *render = headless ? "fakesink name=videosink sync=true"
+                                  : "autovideosink name=videosink";
+    gboolean vp8 = !strcmp(shm.hdr->format, "VP8");
+    gchar *description = g_strdup_printf(
+        "appsrc name=shmsrc is-live=true do-timestamp=true format=time ! queue ! "
+        "%svideoconvert ! %s", vp8 ? "vp8dec ! " : "", render);
+    shm_pipeline = gst_parse_launch(description, &error);
+    g_free(description);
+    if (!shm_pipeline) {
+        lwsl_err("[Receiver] Failed to create local pipeline: %s\n", error->message);
+        g_error_free(error);
+        close(shm_efd);
+        shm_efd = -1;
+        shm_ring_destroy(&shm);
+        return;
+    }
+
+    GstElement *videosink = gst_bin_get_by_name(GST_BIN(shm_pipeline), "videosink");
+    GstPad *sinkpad = gst_element_get_static_pad(videosink, "sink");
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, on_frame, NULL, NULL);
+    gst_object_unref(sinkpad);
+    gst_object_unref(videosink);
+
+    if (active) {
+        peer_free(active);
+        active = NULL;
+    }
+
+    GstElement *src = gst_bin_get_by_name(GST_BIN(shm_pipeline), "shmsrc");
+    gst_element_set_state(shm_pipeline, GST_STATE_PLAYING);
+    g_atomic_int_set(&shm_stop, 0);
+    g_atomic_int_set(&shm_gone, 0);
+    shm_thread = g_thread_new("shm-reader", shm_reader, src);
+    gst_object_unref(src);   // the pipeline keeps it alive until shm_detach
+    lwsl_user("[Receiver] Playing %s frames from shared memory at %s\n", shm.hdr->format, path);
 }
 
 /* LWS callback for the receiver */
@@ -98,68 +1016,148 @@ callback_signaling_client(struct lws *wsi, enum lws_callback_reasons reason,
 
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
         lwsl_user("[Receiver] Connected to server\n");
+        lws_callback_on_writable(wsi);
+        break;
+
+    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+        // Woken by a GStreamer thread: free peers whose recording is done,
+        // start a batch window or send queued messages
+        if (g_atomic_int_compare_and_exchange(&recordings_closed, 1, 0))
+            lws_sul_schedule(context, 0, &retire_sul, reap_retiring, 0);
+
+        g_mutex_lock(&outbox_lock);
+        if ((candidate_batch->len > 0 || candidates_done) && !batch_scheduled) {
+            batch_scheduled = TRUE;
+            lws_sul_schedule(context, 0, &batch_sul, flush_candidate_batch,
+                             candidate_batch->len > 0 ?
+                                 (lws_usec_t)batch_window_ms * LWS_US_PER_MS : 0);
+        }
+        if (!g_queue_is_empty(&outbox))
+            lws_callback_on_writable(client_wsi);
+        g_mutex_unlock(&outbox_lock);
         break;
 
     case LWS_CALLBACK_CLIENT_RECEIVE: {
-        if (psd->len + len >= sizeof(psd->message)) {
+        if (!psd->message)
+            psd->message = g_string_sized_new(4096);
+        if (psd->message->len + len > MAX_MESSAGE_SIZE) {
             lwsl_err("[Receiver] Message too long\n");
             return -1;
         }
-        memcpy(psd->message + psd->len, in, len);
-        psd->len += len;
-        psd->message[psd->len] = '\0';
+        g_string_append_len(psd->message, in, len);
 
         if (lws_is_final_fragment(wsi)) {
-            lwsl_user("[Receiver] Complete msg from server:\n%s\n", psd->message);
+            lwsl_user("[Receiver] Complete msg from server:\n%s\n", psd->message->str);
 
-            if (!strncmp(psd->message, "SERVER_OFFER:", 13)) {
+            if (!strncmp(psd->message->str, "SERVER_SHM:", 11)) {
+                // The sender's ring; the server sends it ahead of any Offer
+                if (use_shm)
+                    shm_attach(psd->message->str + 11);
+            }
+            else if (!strncmp(psd->message->str, "SERVER_OFFER:", 13) &&
+                     shm_pipeline && !g_atomic_int_get(&shm_gone)) {
+                lwsl_user("[Receiver] Playing from shared memory, ignoring Offer\n");
+            }
+            else if (!strncmp(psd->message->str, "SERVER_OFFER:", 13)) {
                 // it's an Offer
-                const char *offer_text = psd->message + 13;
+                const char *offer_text = psd->message->str + 13;
+                gint64 offer_us = g_get_monotonic_time();
                 lwsl_user("[Receiver] Got SDP Offer from server:\n%s\n", offer_text);
 
                 GstSDPMessage *sdp = NULL;
+                struct peer *p = NULL;
+                shm_detach();   // its publisher is gone, if there was one
                 if (gst_sdp_message_new_from_text(offer_text, &sdp) != GST_SDP_OK) {
                     lwsl_err("[Receiver] Failed to parse Offer\n");
+                } else if (!(p = claim_peer())) {
+                    gst_sdp_message_free(sdp);
                 } else {
+                    // A new offer replaces the previous session
+                    if (active)
+                        peer_free(active);
+                    active = p;
+                    p->offer_us = offer_us;
+                    relay_candidate_sent = FALSE;
+                    if (relay_host)
+                        check_ice_port();
+                    lwsl_user("[Receiver] PHASE peer_ready +%.1f ms (pool %s)\n",
+                              (g_get_monotonic_time() - offer_us) / 1000.0,
+                              p->pooled ? "hit" : "miss");
+
                     GstWebRTCSessionDescription *offer =
                         gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_OFFER, sdp);
                     // Set remote desc
-                    g_signal_emit_by_name(webrtc, "set-remote-description", offer, NULL);
+                    g_signal_emit_by_name(p->webrtc, "set-remote-description", offer, NULL);
                     gst_webrtc_session_description_free(offer);
 
                     // create an Answer
                     GstPromise *promise =
-                        gst_promise_new_with_change_func(on_answer_created, wsi, NULL);
-                    g_signal_emit_by_name(webrtc, "create-answer", NULL, promise);
+                        gst_promise_new_with_change_func(on_answer_created, p, NULL);
+                    g_signal_emit_by_name(p->webrtc, "create-answer", NULL, promise);
                 }
             }
-            else if (!strncmp(psd->message, "SERVER_ANSWER:", 14)) {
+            else if (!strncmp(psd->message->str, "SERVER_ANSWER:", 14)) {
                 // We're the receiver, typically we ignore the "SERVER_ANSWER"
                 lwsl_user("[Receiver] Got SERVER_ANSWER from server, ignoring\n");
             }
-            else if (!strncmp(psd->message, "candidate:", 10)) {
-                // ICE candidate from the other side
-                const char *cand = psd->message + 10;
-                handle_remote_candidate(cand);
+            else if (!strncmp(psd->message->str, "candidates:", 11)) {
+                // Batch of ICE candidates from the other side
+                candidates_for_each(psd->message->str + 11, handle_remote_candidate, NULL);
+            }
+            else if (!strncmp(psd->message->str, "candidate:", 10)) {
+                // Single ICE candidate (older peers)
+                const char *cand = psd->message->str + 10;
+                handle_remote_candidate(0, cand, NULL);
+            }
+            else if (!strcmp(psd->message->str, "end-of-candidates")) {
+                lwsl_user("[Receiver] Remote end-of-candidates\n");
+                if (active)
+                    g_signal_emit_by_name(active->webrtc, "add-ice-candidate", 0, "");
             }
             else {
-                lwsl_user("[Receiver] Unknown server msg:\n%s\n", psd->message);
+                lwsl_user("[Receiver] Unknown server msg:\n%s\n", psd->message->str);
             }
 
-            psd->len = 0;
+            g_string_truncate(psd->message, 0);
         }
         break;
     }
 
-    case LWS_CALLBACK_CLIENT_WRITEABLE:
+    case LWS_CALLBACK_CLIENT_WRITEABLE: {
+        // One write per writeable callback; ask again if more is queued
+        g_mutex_lock(&outbox_lock);
+        gchar *msg = g_queue_pop_head(&outbox);
+        gboolean more = !g_queue_is_empty(&outbox);
+        g_mutex_unlock(&outbox_lock);
+
+        if (!msg)
+            break;
+
+        size_t msg_len = strlen(msg);
+        unsigned char *buf = malloc(LWS_PRE + msg_len);
+        memcpy(&buf[LWS_PRE], msg, msg_len);
+        if (lws_write(wsi, &buf[LWS_PRE], msg_len, LWS_WRITE_TEXT) < 0) {
+            lwsl_err("[Receiver] Failed to send message\n");
+        }
+        free(buf);
+        g_free(msg);
+
+        if (more)
+            lws_callback_on_writable(wsi);
         break;
+    }
 
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
         lwsl_err("[Receiver] Connection error\n");
         break;
 
+    case LWS_CALLBACK_CLIENT_CLOSED:
     case LWS_CALLBACK_CLOSED:
         lwsl_user("[Receiver] WebSocket closed\n");
+        if (psd->message) {
+            g_string_free(psd->message, TRUE);
+            psd->message = NULL;
+        }
         break;
 
     default:
@@ -168,15 +1166,60 @@ callback_signaling_client(struct lws *wsi, enum lws_callback_reasons reason,
     return 0;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    int opt;
+
     // Initialize GStreamer
-    gst_init(NULL, NULL);
+    trace_init("receiver_client");
+    gst_init(&argc, &argv);
+    trace_gst_attach();
 
     // Logging
     lws_set_log_level(LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE, NULL);
+
+    while ((opt = getopt(argc, argv, "w:HR:P:p:r:s:l:Nh")) != -1) {
+        switch (opt) {
+        case 'w': batch_window_ms = atoi(optarg); break;
+        case 'H': headless = TRUE; break;
+        case 'R': {
+            const char *colon = strrchr(optarg, ':');
+            if (!colon) {
+                fprintf(stderr, "-R expects host:port\n");
+                return 1;
+            }
+            relay_host = g_strndup(optarg, colon - optarg);
+            relay_port = atoi(colon + 1);
+            break;
+        }
+        case 'P': ice_port = atoi(optarg); break;
+        case 'p': pool_size = atoi(optarg); break;
+        case 'r': record_dir = optarg; break;
+        case 's': segment_s = atoi(optarg); break;
+        case 'l': wanted_layer = optarg; break;
+        case 'N': use_shm = FALSE; break;
+        default:
+            fprintf(stderr, "Usage: %s [-w candidate_batch_ms] [-H] [-R relay_host:port] [-P ice_port]"
+                            " [-p pool_size] [-r record_dir [-s segment_s]] [-l layer] [-N]\n"
+                            "  -H runs headless (no video window)\n"
+                            "  -R forces media through netem_relay, which must forward to ice_port\n"
+                            "  -p keeps that many peers warmed ahead of offers (0 builds on demand, as -R does)\n"
+                            "  -r also records received video to WebM segments in record_dir\n"
+                            "  -l asks a simulcasting sender for layer h, m or l\n"
+                            "  -N always uses WebRTC, even when the sender's ring is on this host\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
     lwsl_user("[Receiver] Starting up\n");
 
+    candidate_batch = g_string_new(NULL);
+    stats.latencies_ms = g_array_new(FALSE, FALSE, sizeof(double));
+    ntp_caps = gst_caps_new_empty_simple("timestamp/x-ntp");
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
     // LWS
     struct lws_context_creation_info info;
     memset(&info, 0, sizeof(info));
@@ -193,7 +1236,7 @@ int main()
     };
     info.protocols = protocols;
 
-    struct lws_context *context = lws_create_context(&info);
+    context = lws_create_context(&info);
     if (!context) {
         lwsl_err("[Receiver] Failed to create LWS context\n");
         return 1;
@@ -214,40 +1257,37 @@ int main()
         lws_context_destroy(context);
         return 1;
     }
+    client_wsi = wsi;
 
-    // GStreamer pipeline: webrtcbin -> autovideosink
-    GstElement *pipeline = gst_parse_launch(
-    "webrtcbin name=webrtcbin "
-    // no stun-server
-    " ! videoconvert ! autovideosink",
-    NULL
-    );
-    if (!pipeline) {
-        lwsl_err("[Receiver] Failed to create pipeline\n");
-        return 1;
+    if (relay_host) {
+        lwsl_user("[Receiver] Relay mode: ICE on port %d, advertising %s:%d\n",
+                  ice_port, relay_host, relay_port);
+        pool_size = 0;
     }
 
-    webrtc = gst_bin_get_by_name(GST_BIN(pipeline), "webrtcbin");
-    if (!webrtc) {
-        lwsl_err("[Receiver] Failed to find webrtcbin\n");
-        return 1;
-    }
+    // Warm up before the offer can arrive
+    pregenerate_certificate();
+    if (pool_size > 0)
+        lws_sul_schedule(context, 0, &pool_sul, refill_pool, 0);
 
-    // Hook up local ICE candidate signal
-    g_signal_connect(webrtc, "on-ice-candidate",
-                     G_CALLBACK(on_ice_candidate), wsi);
-
-    // Start pipeline
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    if (headless)
+        lws_sul_schedule(context, 0, &stats_sul, print_stats, STATS_INTERVAL_MS * LWS_US_PER_MS);
 
     // Main loop
-    while (1) {
+    while (!stop) {
         lws_service(context, 1000);
     }
 
+    print_summary();
+
     // Cleanup
-    gst_element_set_state(pipeline, GST_STATE_NULL);
-    gst_object_unref(pipeline);
+    shm_detach();
+    if (active)
+        peer_free(active);
+    g_queue_clear_full(&pool, (GDestroyNotify)peer_free);
+    // Let recordings finalize their last segment
+    while (!g_queue_is_empty(&retiring))
+        lws_service(context, 100);
     lws_context_destroy(context);
     return 0;
 }
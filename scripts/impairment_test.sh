@@ -0,0 +1,56 @@
+#!/bin/sh
+# Run sender -> netem_relay -> receiver on this host under a scenario and
+# append the receiver's playback summary to a CSV file.
+#
+# Usage: scripts/impairment_test.sh <scenario> [duration_s] [results.csv]
+# Binaries are taken from $BIN (default: current directory).
+set -e
+
+SCENARIO=${1:?usage: $0 <scenario> [duration_s] [results.csv]}
+DURATION=${2:-30}
+RESULTS=${3:-impairment_results.csv}
+BIN=${BIN:-.}
+ICE_PORT=${ICE_PORT:-50000}
+RELAY_PORT=${RELAY_PORT:-40000}
+
+# libnice does not gather loopback candidates, so use the primary address
+HOST_IP=${HOST_IP:-$(hostname -I | awk '{print $1}')}
+LOGS=$(mktemp -d)
+
+cleanup() {
+    kill $SIGNALING $RELAY $SENDER 2>/dev/null || true
+}
+trap cleanup EXIT
+
+"$BIN/signaling_server" > "$LOGS/signaling.log" 2>&1 &
+SIGNALING=$!
+sleep 1
+
+"$BIN/netem_relay" -l "$RELAY_PORT" -t "$HOST_IP:$ICE_PORT" -s "$SCENARIO" > "$LOGS/relay.log" 2>&1 &
+RELAY=$!
+
+"$BIN/receiver_client" -H -R "$HOST_IP:$RELAY_PORT" -P "$ICE_PORT" > "$LOGS/receiver.log" 2>&1 &
+RECEIVER=$!
+sleep 1
+
+"$BIN/sender_client" > "$LOGS/sender.log" 2>&1 &
+SENDER=$!
+
+sleep "$DURATION"
+kill -INT $RECEIVER
+wait $RECEIVER || true
+
+SUMMARY=$(grep SUMMARY "$LOGS/receiver.log" | tail -n 1 | sed 's/.*SUMMARY //')
+if [ -z "$SUMMARY" ]; then
+    echo "No summary from receiver, logs in $LOGS" >&2
+    exit 1
+fi
+
+BUILD=$(git describe --always --dirty 2>/dev/null || echo unknown)
+if [ ! -f "$RESULTS" ]; then
+    echo "build,scenario,$(echo "$SUMMARY" | sed 's/=[^ ]*//g; s/ /,/g')" > "$RESULTS"
+fi
+echo "$BUILD,$(basename "$SCENARIO"),$(echo "$SUMMARY" | sed 's/[^ ]*=//g; s/ /,/g')" >> "$RESULTS"
+
+echo "$SUMMARY"
+echo "Logs in $LOGS, results appended to $RESULTS"
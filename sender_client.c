@@ -1,52 +1,716 @@
+#define _GNU_SOURCE
 #include <libwebsockets.h>
 #include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/rtp/rtp.h>
 #include <gst/webrtc/webrtc.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include "shm_ring.h"
+#include "candidates.h"
+#include "trace.h"
+
+// Local ICE candidates are collected for this long and sent as one message
+#define DEFAULT_BATCH_WINDOW_MS 20
+
+// Adaptive bitrate: poll webrtcbin stats this often and adjust the encoder
+#define ABR_INTERVAL_MS        1000
+#define DEFAULT_START_KBPS     800
+#define DEFAULT_MIN_KBPS       100
+#define DEFAULT_MAX_KBPS       2500
+
+// Resolution/framerate used for a given bitrate. We step down once the
+// bitrate drops below min_kbps and only step up again with some headroom.
+struct abr_level {
+    int width;
+    int height;
+    int fps;
+    int min_kbps;
+};
+
+static const struct abr_level abr_ladder[] = {
+    { 640, 480, 30, 500 },
+    { 480, 360, 30, 300 },
+    { 320, 240, 20, 150 },
+    { 160, 120, 15, 0 },
+};
+#define ABR_LEVELS (sizeof(abr_ladder) / sizeof(abr_ladder[0]))
+#define ABR_UPSWITCH_HEADROOM 1.3
+
+// Simulcast (-L): one capture is scaled and encoded per layer, each layer's
+// RTP carries its RID and its own SSRC, and rtpfunnel puts them on one
+// transceiver. An SFU asks for every layer with "send-all-layers" and picks
+// one per subscriber itself. Peer-to-peer, a valve in front of each encoder
+// leaves only the layer the receiver picked with "select-layer:<rid>".
+#define RTP_RID_URI "urn:ietf:params:rtp-hdrext:sdes:rtp-stream-id"
+#define RTP_TWCC_URI "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
+#define MAX_SIMULCAST_LAYERS 3
+
+struct simulcast_layer {
+    const char *rid;
+    int width;
+    int height;
+    int fps;
+    int kbps;
+};
+
+static const struct simulcast_layer simulcast_layers[MAX_SIMULCAST_LAYERS] = {
+    { "h", 640, 480, 30, 1200 },
+    { "m", 320, 240, 30, 400 },
+    { "l", 160, 120, 15, 150 },
+};
+
+static int simulcast_count = 0;   // 0 = single stream
+static GstElement *layer_valve[MAX_SIMULCAST_LAYERS];
+static GstElement *layer_pay[MAX_SIMULCAST_LAYERS];
 
 static GstElement *webrtc = NULL;
+static GstElement *encoder = NULL;
+static GstElement *abr_caps = NULL;
+static struct lws_context *context = NULL;
+static struct lws *client_wsi = NULL;
+
+// Upper bound on one assembled signaling message; an Answer can be well past 4 KB
+#define MAX_MESSAGE_SIZE (1024 * 1024)
 
 // We store partial incoming messages here
 struct client_session_data {
-    char message[2048];
-    size_t len;
+    GString *message;     // assembled from fragments, up to MAX_MESSAGE_SIZE
 };
 
+// Outgoing signaling messages. GStreamer calls us from its own threads, so
+// everything is queued here and written from the lws service thread.
+static GMutex outbox_lock;
+static GQueue outbox = G_QUEUE_INIT;
+static GString *candidate_batch = NULL;   // "<mlineindex> <candidate>\n" lines
+static gboolean candidates_done = FALSE;  // end-of-candidates still to send
+static gboolean batch_scheduled = FALSE;
+static int batch_window_ms = DEFAULT_BATCH_WINDOW_MS;
+static lws_sorted_usec_list_t batch_sul;
+
+// Adaptive bitrate state. Only touched from the get-stats promise callback,
+// except abr_gcc_kbps, which rtpgccbwe updates from a streaming thread.
+static gboolean abr_enabled = TRUE;
+static int abr_min_kbps = DEFAULT_MIN_KBPS;
+static int abr_max_kbps = DEFAULT_MAX_KBPS;
+static double abr_kbps = DEFAULT_START_KBPS;
+static double abr_min_rtt = 0;
+static gint abr_gcc_kbps = 0;     // estimate from rtpgccbwe, if available (atomic)
+static guint abr_level = 0;
+static lws_sorted_usec_list_t abr_sul;
+
+// Setup phases, in microseconds since startup (0 = not yet). The pipeline is
+// started right after the WebSocket connect is initiated, so creating the
+// Offer, generating the DTLS certificate and gathering ICE candidates all
+// overlap with connecting to the server rather than following it.
+struct setup_timing {
+    gint64 start_us;
+    gint64 offer_us;
+    gint64 connected_ws_us;
+    gint64 gathered_us;
+    gint64 answer_us;
+    gint64 ice_us;
+    gint64 connected_us;
+};
+
+static struct setup_timing setup;
+
+// Local transport: frames are also published into a shared-memory ring for
+// consumers on this host, which learn the socket path from the signaling
+// server. Raw I420 by default, or the encoded VP8 frames with -E.
+#define SHM_SLOTS 4
+#define SHM_SLOT_SIZE (640 * 480 * 3 / 2)   // top rung of abr_ladder, I420
+
+static const char *shm_path = NULL;
+static gboolean shm_encoded = FALSE;
+static struct shm_ring shm_ring;
+
+// Data-channel benchmark (-D seconds). A bulk channel sends large messages
+// as fast as flow control allows; buffered-amount is kept between the two
+// water marks. A probe channel sends small timestamped records at a fixed
+// rate, packed -k to a message, which the receiver echoes back for RTT.
+// Both share the peer connection with the video.
+#define DC_BULK_MSG_SIZE (16 * 1024)
+#define DC_HIGH_WATER (4 * 1024 * 1024)
+#define DC_LOW_WATER (1 * 1024 * 1024)
+#define DC_PROBE_SIZE 64            // bytes per probe record
+#define DC_PROBE_RATE 1000          // probe records per second
+#define DC_TICK_MS 10
+#define DC_REPORT_MS 1000
+
+struct dc_probe {
+    guint64 seq;
+    gint64 sent_us;
+    char pad[DC_PROBE_SIZE - 16];
+};
+
+struct dc_bench {
+    GMutex lock;
+    gboolean running;
+    gint64 start_us;
+    gint64 report_us;
+    guint64 bulk_bytes;       // handed to send-data
+    guint64 report_bytes;     // bulk_out() at the last report
+    guint64 probes_sent;
+    guint64 probe_msgs;
+    guint64 probes_echoed;
+    GArray *rtt_ms;
+};
+
+static int dc_duration_s = 0;
+static int dc_batch = 1;                // probe records per message
+static gboolean dc_bulk_unreliable = FALSE;
+static GstWebRTCDataChannel *bulk_channel = NULL;
+static GstWebRTCDataChannel *probe_channel = NULL;
+static struct dc_bench bench;
+static lws_sorted_usec_list_t dc_sul;
+static gint dc_start_pending = 0;       // channels opened, dc_tick not yet running
+
 // Forward declarations
 static void on_offer_created(GstPromise *promise, gpointer wsi);
 
+/* Queue a message for the server (takes ownership of msg) */
+static void queue_message(gchar *msg)
+{
+    g_mutex_lock(&outbox_lock);
+    g_queue_push_tail(&outbox, msg);
+    g_mutex_unlock(&outbox_lock);
+    lws_cancel_service(context);
+}
+
+/* Batch window elapsed: turn the collected candidates into one message */
+static void flush_candidate_batch(lws_sorted_usec_list_t *sul)
+{
+    g_mutex_lock(&outbox_lock);
+    if (candidate_batch->len > 0) {
+        g_queue_push_tail(&outbox, g_strdup_printf(CANDIDATES_PREFIX "%s", candidate_batch->str));
+        g_string_truncate(candidate_batch, 0);
+    }
+    if (candidates_done) {
+        g_queue_push_tail(&outbox, g_strdup("end-of-candidates"));
+        candidates_done = FALSE;
+    }
+    batch_scheduled = FALSE;
+    g_mutex_unlock(&outbox_lock);
+
+    lws_callback_on_writable(client_wsi);
+}
+
+/* Record the first time a setup phase is reached */
+static void mark_phase(gint64 *phase, const char *name)
+{
+    if (*phase)
+        return;
+    *phase = g_get_monotonic_time() - setup.start_us;
+    lwsl_user("Sender: PHASE %s +%.1f ms\n", name, *phase / 1000.0);
+    trace_event(name, "setup", setup.start_us, *phase);
+}
+
+/* Header extensions for a simulcast payloader: its RID, and TWCC */
+static GstRTPHeaderExtension *on_request_extension(GstElement *pay, guint ext_id,
+                                                   const gchar *uri, gpointer user_data)
+{
+    GstRTPHeaderExtension *ext = gst_rtp_header_extension_create_from_uri(uri);
+    if (!ext)
+        return NULL;
+    gst_rtp_header_extension_set_id(ext, ext_id);
+    if (!strcmp(uri, RTP_RID_URI))
+        g_object_set(ext, "rid", (const gchar *)user_data, NULL);
+    return ext;
+}
+
+/* Ask a layer's encoder for a keyframe */
+static void force_layer_keyframe(int layer)
+{
+    GstPad *sinkpad = gst_element_get_static_pad(layer_pay[layer], "sink");
+    GstStructure *s = gst_structure_new("GstForceKeyUnit",
+                                        "all-headers", G_TYPE_BOOLEAN, TRUE, NULL);
+    gst_pad_push_event(sinkpad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, s));
+    gst_object_unref(sinkpad);
+}
+
+/* Send every layer at once, for an SFU that forwards one per subscriber */
+static void send_all_layers(void)
+{
+    for (int i = 0; i < simulcast_count; i++) {
+        g_object_set(layer_valve[i], "drop", FALSE, NULL);
+        force_layer_keyframe(i);
+    }
+    lwsl_user("Sender: Sending all %d simulcast layers\n", simulcast_count);
+}
+
+/* Send only the selected layer, starting it on a keyframe */
+static void select_layer(const char *rid)
+{
+    int selected = -1;
+
+    for (int i = 0; i < simulcast_count; i++)
+        if (!strcmp(simulcast_layers[i].rid, rid))
+            selected = i;
+    if (selected < 0) {
+        lwsl_warn("Sender: No simulcast layer \"%s\"\n", rid);
+        return;
+    }
+
+    for (int i = 0; i < simulcast_count; i++)
+        g_object_set(layer_valve[i], "drop", i != selected, NULL);
+    force_layer_keyframe(selected);
+
+    lwsl_user("Sender: Sending simulcast layer %s (%dx%d)\n", rid,
+              simulcast_layers[selected].width, simulcast_layers[selected].height);
+}
+
+/* Encoder branches for every layer, joined by rtpfunnel. The capture tee is
+ * named "local" so the shared-memory branch can hang off it as well. */
+static gchar *simulcast_launch(void)
+{
+    GString *launch = g_string_new(
+        "videotestsrc is-live=true ! video/x-raw,width=640,height=480,framerate=30/1 ! "
+        "tee name=local ");
+
+    for (int i = 0; i < simulcast_count; i++) {
+        const struct simulcast_layer *l = &simulcast_layers[i];
+        g_string_append_printf(launch,
+            "local. ! queue leaky=downstream max-size-buffers=2 ! valve name=valve_%s drop=%s ! "
+            "videoscale ! videorate ! video/x-raw,width=%d,height=%d,framerate=%d/1 ! "
+            "videoconvert ! vp8enc name=enc_%s deadline=1 target-bitrate=%d ! "
+            "rtpvp8pay name=pay_%s auto-header-extension=true ! "
+            "application/x-rtp,media=video,encoding-name=VP8,payload=96,"
+            "extmap-1=(string)" RTP_TWCC_URI ",extmap-2=(string)" RTP_RID_URI " ! funnel. ",
+            l->rid, i == 0 ? "false" : "true", l->width, l->height, l->fps,
+            l->rid, l->kbps * 1000, l->rid);
+    }
+    g_string_append(launch, "rtpfunnel name=funnel ! webrtcbin name=webrtcbin ");
+    return g_string_free(launch, FALSE);
+}
+
+/* Codec preferences announcing the layers, so the Offer carries a=rid and
+ * a=simulcast lines */
+static void set_simulcast_preferences(void)
+{
+    GstPad *sinkpad = gst_element_get_static_pad(webrtc, "sink_0");
+    GstWebRTCRTPTransceiver *trans = NULL;
+    GstCaps *caps = gst_caps_from_string(
+        "application/x-rtp,media=video,encoding-name=VP8,payload=96,clock-rate=90000,"
+        "extmap-1=(string)" RTP_TWCC_URI ",extmap-2=(string)" RTP_RID_URI);
+
+    for (int i = 0; i < simulcast_count; i++) {
+        gchar *field = g_strdup_printf("rid-%s", simulcast_layers[i].rid);
+        gst_caps_set_simple(caps, field, G_TYPE_STRING, "send", NULL);
+        g_free(field);
+    }
+
+    g_object_get(sinkpad, "transceiver", &trans, NULL);
+    g_object_set(trans, "codec-preferences", caps, NULL);
+    gst_object_unref(trans);
+    gst_caps_unref(caps);
+    gst_object_unref(sinkpad);
+}
+
+static int compare_doubles(gconstpointer a, gconstpointer b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Fill the bulk channel up to the high-water mark. Called when it opens
+ * and whenever buffered-amount falls below the low-water mark. */
+static void pump_bulk(void)
+{
+    static guint8 payload[DC_BULK_MSG_SIZE];
+    guint64 buffered = 0;
+
+    g_mutex_lock(&bench.lock);
+    while (bench.running) {
+        g_object_get(bulk_channel, "buffered-amount", &buffered, NULL);
+        if (buffered >= DC_HIGH_WATER)
+            break;
+        GBytes *bytes = g_bytes_new_static(payload, sizeof(payload));
+        g_signal_emit_by_name(bulk_channel, "send-data", bytes);
+        g_bytes_unref(bytes);
+        bench.bulk_bytes += sizeof(payload);
+    }
+    g_mutex_unlock(&bench.lock);
+}
+
+/* Bulk bytes that have left the channel's send buffer for SCTP. On an
+ * unreliable channel SCTP may still drop some; the receiver's DATA line
+ * shows what arrived. Called with bench.lock held. */
+static guint64 bulk_out(void)
+{
+    guint64 buffered = 0;
+
+    g_object_get(bulk_channel, "buffered-amount", &buffered, NULL);
+    return bench.bulk_bytes - MIN(buffered, bench.bulk_bytes);
+}
+
+static void on_bulk_low(GstWebRTCDataChannel *channel, gpointer user_data)
+{
+    pump_bulk();
+}
+
+/* Echoed probe records: one RTT sample each */
+static void on_probe_echo(GstWebRTCDataChannel *channel, GBytes *data, gpointer user_data)
+{
+    gsize len;
+    const struct dc_probe *probe = g_bytes_get_data(data, &len);
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&bench.lock);
+    for (gsize i = 0; i < len / sizeof(*probe); i++) {
+        double rtt = (now - probe[i].sent_us) / 1000.0;
+        g_array_append_val(bench.rtt_ms, rtt);
+        bench.probes_echoed++;
+    }
+    g_mutex_unlock(&bench.lock);
+}
+
+static void print_dc_summary(void)
+{
+    double elapsed = (g_get_monotonic_time() - bench.start_us) / 1e6;
+    double p50 = 0, p95 = 0, p99 = 0;
+    guint n = bench.rtt_ms->len;
+
+    if (n > 0) {
+        g_array_sort(bench.rtt_ms, compare_doubles);
+        p50 = g_array_index(bench.rtt_ms, double, (guint)(0.50 * (n - 1)));
+        p95 = g_array_index(bench.rtt_ms, double, (guint)(0.95 * (n - 1)));
+        p99 = g_array_index(bench.rtt_ms, double, (guint)(0.99 * (n - 1)));
+    }
+
+    printf("Sender: DATACHANNEL bulk=%s bulk_out_mbps=%.1f probes_sent=%" G_GUINT64_FORMAT
+           " probes_echoed=%" G_GUINT64_FORMAT " probe_msgs_per_s=%.0f batch=%d"
+           " rtt_p50_ms=%.2f rtt_p95_ms=%.2f rtt_p99_ms=%.2f\n",
+           dc_bulk_unreliable ? "unreliable" : "reliable",
+           bulk_out() * 8 / elapsed / 1e6, bench.probes_sent, bench.probes_echoed,
+           bench.probe_msgs / elapsed, dc_batch, p50, p95, p99);
+    fflush(stdout);
+}
+
+/* lws timer: send this tick's probes and report once a second */
+static void dc_tick(lws_sorted_usec_list_t *sul)
+{
+    static struct dc_probe records[DC_PROBE_RATE * DC_TICK_MS / 1000];
+    int count = G_N_ELEMENTS(records);
+    gint64 now = g_get_monotonic_time();
+
+    // Probes are packed dc_batch to a message, fewer in the last one
+    for (int i = 0; i < count; i += dc_batch) {
+        int n = MIN(dc_batch, count - i);
+        for (int j = 0; j < n; j++) {
+            records[i + j].seq = bench.probes_sent + j;
+            records[i + j].sent_us = now;
+        }
+        GBytes *bytes = g_bytes_new(&records[i], n * sizeof(records[0]));
+        g_signal_emit_by_name(probe_channel, "send-data", bytes);
+        g_bytes_unref(bytes);
+        bench.probes_sent += n;
+        bench.probe_msgs++;
+    }
+
+    g_mutex_lock(&bench.lock);
+    if (now - bench.report_us >= DC_REPORT_MS * 1000) {
+        guint64 out = bulk_out();
+        lwsl_user("Sender: DATA bulk_out_mbps=%.1f probes=%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "\n",
+                  (out - MIN(out, bench.report_bytes)) * 8 / ((now - bench.report_us) / 1e6) / 1e6,
+                  bench.probes_echoed, bench.probes_sent);
+        bench.report_bytes = out;
+        bench.report_us = now;
+    }
+    if (now - bench.start_us >= (gint64)dc_duration_s * G_USEC_PER_SEC) {
+        bench.running = FALSE;
+        print_dc_summary();
+    }
+    gboolean running = bench.running;
+    g_mutex_unlock(&bench.lock);
+
+    if (running)
+        lws_sul_schedule(context, 0, &dc_sul, dc_tick, DC_TICK_MS * LWS_US_PER_MS);
+}
+
+/* Both channels are open: start the benchmark from the lws thread */
+static void on_channel_open(GstWebRTCDataChannel *channel, gpointer user_data)
+{
+    GstWebRTCDataChannelState bulk_state, probe_state;
+    g_object_get(bulk_channel, "ready-state", &bulk_state, NULL);
+    g_object_get(probe_channel, "ready-state", &probe_state, NULL);
+    if (bulk_state != GST_WEBRTC_DATA_CHANNEL_STATE_OPEN ||
+        probe_state != GST_WEBRTC_DATA_CHANNEL_STATE_OPEN)
+        return;
+
+    g_mutex_lock(&bench.lock);
+    if (!bench.running && !bench.start_us) {
+        lwsl_user("Sender: Data channels open, benchmarking for %d s\n", dc_duration_s);
+        bench.running = TRUE;
+        bench.start_us = bench.report_us = g_get_monotonic_time();
+    }
+    g_mutex_unlock(&bench.lock);
+
+    pump_bulk();
+    g_atomic_int_set(&dc_start_pending, 1);
+    lws_cancel_service(context);
+}
+
+static GstWebRTCDataChannel *create_channel(const char *label, gboolean reliable)
+{
+    GstWebRTCDataChannel *channel = NULL;
+    GstStructure *options = reliable ? NULL :
+        gst_structure_new("options", "ordered", G_TYPE_BOOLEAN, FALSE,
+                          "max-retransmits", G_TYPE_INT, 0, NULL);
+
+    g_signal_emit_by_name(webrtc, "create-data-channel", label, options, &channel);
+    if (options)
+        gst_structure_free(options);
+    if (channel)
+        g_signal_connect(channel, "on-open", G_CALLBACK(on_channel_open), NULL);
+    return channel;
+}
+
+/* Data channels must exist before the Offer so it carries an SCTP section */
+static gboolean setup_data_channels(void)
+{
+    bulk_channel = create_channel("bench-bulk", !dc_bulk_unreliable);
+    probe_channel = create_channel("bench-probe", FALSE);
+    if (!bulk_channel || !probe_channel)
+        return FALSE;
+
+    g_object_set(bulk_channel, "buffered-amount-low-threshold", (guint64)DC_LOW_WATER, NULL);
+    g_signal_connect(bulk_channel, "on-buffered-amount-low", G_CALLBACK(on_bulk_low), NULL);
+    g_signal_connect(probe_channel, "on-message-data", G_CALLBACK(on_probe_echo), NULL);
+    bench.rtt_ms = g_array_new(FALSE, FALSE, sizeof(double));
+    return TRUE;
+}
+
+/* appsink streaming thread: copy the frame into the shared-memory ring */
+static GstFlowReturn on_local_sample(GstAppSink *sink, gpointer user_data)
+{
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (!sample)
+        return GST_FLOW_EOS;
+
+    GstBuffer *buf = gst_sample_get_buffer(sample);
+    GstStructure *s = gst_caps_get_structure(gst_sample_get_caps(sample), 0);
+    int width = 0, height = 0;
+    GstMapInfo map;
+
+    gst_structure_get_int(s, "width", &width);
+    gst_structure_get_int(s, "height", &height);
+    if (gst_buffer_map(buf, &map, GST_MAP_READ)) {
+        if (shm_ring_publish(&shm_ring, map.data, map.size, GST_BUFFER_PTS(buf),
+                             width, height) < 0)
+            lwsl_warn("Sender: %zu byte frame does not fit a ring slot\n", map.size);
+        gst_buffer_unmap(buf, &map);
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
 /* ICE candidate from the local (sender) side */
 static void on_ice_candidate(GstElement *webrtcbin, guint mlineindex,
                              gchar *candidate, gpointer user_data)
 {
-    struct lws *wsi = (struct lws *)user_data;
     lwsl_user("Sender: Got local ICE candidate:\n%s\n", candidate);
 
-    gchar *msg = g_strdup_printf("candidate:%s", candidate);
-    unsigned char *buf = malloc(LWS_PRE + strlen(msg) + 1);
-    memset(buf, 0, LWS_PRE + strlen(msg) + 1);
-    memcpy(&buf[LWS_PRE], msg, strlen(msg));
+    g_mutex_lock(&outbox_lock);
+    candidates_batch_add(candidate_batch, &outbox, "", mlineindex, candidate);
+    g_mutex_unlock(&outbox_lock);
+    lws_cancel_service(context);
+}
+
+/* Gathering finished: tell the peer no more candidates will follow */
+static void on_ice_gathering_state(GstElement *webrtcbin, GParamSpec *pspec,
+                                   gpointer user_data)
+{
+    GstWebRTCICEGatheringState state;
+    g_object_get(webrtcbin, "ice-gathering-state", &state, NULL);
 
-    if (lws_write(wsi, &buf[LWS_PRE], strlen(msg), LWS_WRITE_TEXT) < 0) {
-        lwsl_err("Sender: Failed to send ICE candidate\n");
+    if (state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE) {
+        mark_phase(&setup.gathered_us, "ice_gathered");
+        g_mutex_lock(&outbox_lock);
+        candidates_done = TRUE;
+        g_mutex_unlock(&outbox_lock);
+        lws_cancel_service(context);
     }
+}
+
+static void on_ice_connection_state(GstElement *webrtcbin, GParamSpec *pspec,
+                                    gpointer user_data)
+{
+    GstWebRTCICEConnectionState state;
+    g_object_get(webrtcbin, "ice-connection-state", &state, NULL);
+
+    if (state == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED ||
+        state == GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED)
+        mark_phase(&setup.ice_us, "ice_connected");
+}
+
+/* Connected means ICE and the DTLS handshake have both finished */
+static void on_connection_state(GstElement *webrtcbin, GParamSpec *pspec,
+                                gpointer user_data)
+{
+    GstWebRTCPeerConnectionState state;
+    g_object_get(webrtcbin, "connection-state", &state, NULL);
 
-    free(buf);
-    g_free(msg);
+    if (state == GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED && !setup.connected_us) {
+        mark_phase(&setup.connected_us, "dtls_connected");
+        printf("Sender: SETUP offer_ms=%.1f ws_ms=%.1f gathered_ms=%.1f answer_ms=%.1f "
+               "ice_ms=%.1f connected_ms=%.1f\n",
+               setup.offer_us / 1000.0, setup.connected_ws_us / 1000.0,
+               setup.gathered_us / 1000.0, setup.answer_us / 1000.0,
+               setup.ice_us / 1000.0, setup.connected_us / 1000.0);
+        fflush(stdout);
+    }
 }
 
 /* Add a remote ICE candidate on this side (sender) */
-static void handle_remote_candidate(const char *candidate_sdp)
+static void handle_remote_candidate(unsigned mlineindex, const char *candidate_sdp, void *user)
 {
     lwsl_user("Sender: Adding remote ICE candidate:\n%s\n", candidate_sdp);
-    g_signal_emit_by_name(webrtc, "add-ice-candidate", 0, candidate_sdp);
+    g_signal_emit_by_name(webrtc, "add-ice-candidate", mlineindex, candidate_sdp);
+}
+
+/* Apply a resolution/framerate level to the capture caps */
+static void abr_set_level(guint level)
+{
+    const struct abr_level *l = &abr_ladder[level];
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "width", G_TYPE_INT, l->width,
+                                        "height", G_TYPE_INT, l->height,
+                                        "framerate", GST_TYPE_FRACTION, l->fps, 1,
+                                        NULL);
+    g_object_set(abr_caps, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    abr_level = level;
+}
+
+/* Transport stats collected from one get-stats reply */
+struct abr_sample {
+    gboolean have_report;
+    double fraction_lost;
+    double rtt;
+    double jitter;
+};
+
+static gboolean collect_stats(GQuark field, const GValue *value, gpointer user_data)
+{
+    struct abr_sample *sample = user_data;
+    GstWebRTCStatsType type;
+    const GstStructure *s;
+
+    if (!GST_VALUE_HOLDS_STRUCTURE(value))
+        return TRUE;
+    s = gst_value_get_structure(value);
+    if (!gst_structure_get(s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL))
+        return TRUE;
+
+    // RTCP receiver reports from the remote side
+    if (type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP) {
+        sample->have_report = TRUE;
+        gst_structure_get_double(s, "fraction-lost", &sample->fraction_lost);
+        gst_structure_get_double(s, "round-trip-time", &sample->rtt);
+        gst_structure_get_double(s, "jitter", &sample->jitter);
+    }
+    return TRUE;
+}
+
+/* Loss/delay based controller, run once per stats poll */
+static void on_stats(GstPromise *promise, gpointer user_data)
+{
+    struct abr_sample sample = { FALSE, 0, 0, 0 };
+    const GstStructure *reply;
+
+    if (gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED) {
+        gst_promise_unref(promise);
+        return;
+    }
+    reply = gst_promise_get_reply(promise);
+    gst_structure_foreach(reply, collect_stats, &sample);
+    gst_promise_unref(promise);
+
+    if (!sample.have_report)
+        return;
+
+    // Loss: back off proportionally above 10%, probe upwards below 2%
+    if (sample.fraction_lost > 0.10)
+        abr_kbps *= 1.0 - 0.5 * sample.fraction_lost;
+    else if (sample.fraction_lost < 0.02)
+        abr_kbps *= 1.08;
+
+    // Delay: a growing RTT means queues are building up along the path,
+    // which shows up as jitter-buffer bloat on the receiver
+    if (sample.rtt > 0) {
+        if (abr_min_rtt == 0 || sample.rtt < abr_min_rtt)
+            abr_min_rtt = sample.rtt;
+        else if (sample.rtt > abr_min_rtt * 1.5 + 0.05)
+            abr_kbps *= 0.85;
+    }
+
+    gint gcc_kbps = g_atomic_int_get(&abr_gcc_kbps);
+    if (gcc_kbps > 0 && abr_kbps > gcc_kbps)
+        abr_kbps = gcc_kbps;
+    if (abr_kbps < abr_min_kbps)
+        abr_kbps = abr_min_kbps;
+    if (abr_kbps > abr_max_kbps)
+        abr_kbps = abr_max_kbps;
+
+    g_object_set(encoder, "target-bitrate", (int)(abr_kbps * 1000), NULL);
+
+    guint level = abr_level;
+    while (level + 1 < ABR_LEVELS && abr_kbps < abr_ladder[level].min_kbps)
+        level++;
+    while (level > 0 && abr_kbps > abr_ladder[level - 1].min_kbps * ABR_UPSWITCH_HEADROOM)
+        level--;
+    if (level != abr_level)
+        abr_set_level(level);
+
+    lwsl_user("Sender: ABR loss=%.1f%% rtt=%.0fms jitter=%.1fms -> %.0f kbps %dx%d@%d\n",
+              sample.fraction_lost * 100, sample.rtt * 1000, sample.jitter * 1000,
+              abr_kbps, abr_ladder[abr_level].width, abr_ladder[abr_level].height,
+              abr_ladder[abr_level].fps);
+}
+
+/* Timer on the lws service thread: request fresh stats */
+static void abr_poll(lws_sorted_usec_list_t *sul)
+{
+    GstPromise *promise = gst_promise_new_with_change_func(on_stats, NULL, NULL);
+    g_signal_emit_by_name(webrtc, "get-stats", NULL, promise);
+    lws_sul_schedule(context, 0, &abr_sul, abr_poll, ABR_INTERVAL_MS * LWS_US_PER_MS);
+}
+
+/* Delay-based estimate from TWCC feedback (rtpgccbwe) */
+static void on_gcc_estimate(GstElement *bwe, GParamSpec *pspec, gpointer user_data)
+{
+    guint bps;
+    g_object_get(bwe, "estimated-bitrate", &bps, NULL);
+    g_atomic_int_set(&abr_gcc_kbps, (gint)(bps / 1000));
+}
+
+/* Give webrtcbin a TWCC bandwidth estimator when the plugin is installed */
+static GstElement *on_request_aux_sender(GstElement *webrtcbin,
+                                         GstWebRTCDTLSTransport *transport,
+                                         gpointer user_data)
+{
+    GstElement *bwe = gst_element_factory_make("rtpgccbwe", NULL);
+    if (!bwe)
+        return NULL;
+
+    lwsl_user("Sender: Using rtpgccbwe for TWCC bandwidth estimation\n");
+    g_object_set(bwe, "min-bitrate", abr_min_kbps * 1000,
+                 "max-bitrate", abr_max_kbps * 1000,
+                 "estimated-bitrate", (guint)(abr_kbps * 1000), NULL);
+    g_signal_connect(bwe, "notify::estimated-bitrate", G_CALLBACK(on_gcc_estimate), NULL);
+    return bwe;
 }
 
 /* create SDP Offer */
+static gint64 offer_requested_us = 0, offer_queued_us = 0;
+
 static void on_negotiation_needed(GstElement *webrtcbin, gpointer wsi)
 {
     lwsl_user("Sender: on_negotiation_needed\n");
+    offer_requested_us = trace_now_us();
     GstPromise *promise = gst_promise_new_with_change_func(on_offer_created, wsi, NULL);
     g_signal_emit_by_name(webrtcbin, "create-offer", NULL, promise);
 }
@@ -54,7 +718,6 @@ static void on_negotiation_needed(GstElement *webrtcbin, gpointer wsi)
 /* Called after create-offer finishes */
 static void on_offer_created(GstPromise *promise, gpointer user_data)
 {
-    struct lws *wsi = (struct lws *)user_data;
     gst_promise_wait(promise);
 
     const GstStructure *reply = gst_promise_get_reply(promise);
@@ -69,24 +732,17 @@ static void on_offer_created(GstPromise *promise, gpointer user_data)
     gchar *sdp_text = gst_sdp_message_as_text(offer->sdp);
     lwsl_user("Sender: Created SDP Offer:\n%s\n", sdp_text);
 
-    // Set local desc
+    // Set local desc; this starts ICE gathering
     g_signal_emit_by_name(webrtc, "set-local-description", offer, NULL);
     gst_webrtc_session_description_free(offer);
+    mark_phase(&setup.offer_us, "offer_created");
+    TRACE_SPAN(create_offer, "signaling", offer_requested_us);
     gst_promise_unref(promise);
 
     // Send Offer to server
-    unsigned char *buf = malloc(LWS_PRE + strlen(sdp_text) + 1);
-    memset(buf, 0, LWS_PRE + strlen(sdp_text) + 1);
-    memcpy(&buf[LWS_PRE], sdp_text, strlen(sdp_text));
-
-    if (lws_write(wsi, &buf[LWS_PRE], strlen(sdp_text), LWS_WRITE_TEXT) < 0) {
-        lwsl_err("Sender: Failed to send SDP Offer\n");
-    } else {
-        lwsl_user("Sender: Sent SDP Offer to server\n");
-    }
-
-    free(buf);
-    g_free(sdp_text);
+    offer_queued_us = trace_now_us();
+    queue_message(sdp_text);
+    lwsl_user("Sender: Queued SDP Offer for server\n");
 }
 
 /* LWS callback for the sender */
@@ -98,30 +754,90 @@ static int websocket_callback(struct lws *wsi, enum lws_callback_reasons reason,
     switch (reason) {
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
         lwsl_user("Sender: WebSocket connection established\n");
+        mark_phase(&setup.connected_ws_us, "websocket_connected");
+        if (shm_path) {
+            // Advertise the ring; only consumers with the same host id use it
+            char host_id[128];
+            shm_ring_host_id(host_id, sizeof(host_id));
+            queue_message(g_strdup_printf("shm-endpoint:%s %s", host_id, shm_path));
+        }
         // We'll let "on-negotiation-needed" be called automatically by webrtcbin
+        lws_callback_on_writable(wsi);
+        break;
+
+    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+        // Woken by a GStreamer thread: start a batch window or send queued messages
+        if (g_atomic_int_compare_and_exchange(&dc_start_pending, 1, 0))
+            lws_sul_schedule(context, 0, &dc_sul, dc_tick, 0);
+
+        g_mutex_lock(&outbox_lock);
+        if ((candidate_batch->len > 0 || candidates_done) && !batch_scheduled) {
+            batch_scheduled = TRUE;
+            lws_sul_schedule(context, 0, &batch_sul, flush_candidate_batch,
+                             candidate_batch->len > 0 ?
+                                 (lws_usec_t)batch_window_ms * LWS_US_PER_MS : 0);
+        }
+        if (!g_queue_is_empty(&outbox))
+            lws_callback_on_writable(client_wsi);
+        g_mutex_unlock(&outbox_lock);
         break;
 
+    case LWS_CALLBACK_CLIENT_WRITEABLE: {
+        // One write per writeable callback; ask again if more is queued
+        g_mutex_lock(&outbox_lock);
+        gchar *msg = g_queue_pop_head(&outbox);
+        gboolean more = !g_queue_is_empty(&outbox);
+        g_mutex_unlock(&outbox_lock);
+
+        if (!msg)
+            break;
+
+        size_t msg_len = strlen(msg);
+        unsigned char *buf = malloc(LWS_PRE + msg_len);
+        memcpy(&buf[LWS_PRE], msg, msg_len);
+        if (lws_write(wsi, &buf[LWS_PRE], msg_len, LWS_WRITE_TEXT) < 0) {
+            lwsl_err("Sender: Failed to send message\n");
+        }
+        if (!strncmp(msg, "v=0", 3))
+            TRACE_SPAN(offer_queued_to_write, "signaling", offer_queued_us);
+        free(buf);
+        g_free(msg);
+
+        if (more)
+            lws_callback_on_writable(wsi);
+        break;
+    }
+
     case LWS_CALLBACK_CLIENT_RECEIVE: {
-        if (csd->len + len >= sizeof(csd->message)) {
+        if (!csd->message)
+            csd->message = g_string_sized_new(4096);
+        if (csd->message->len + len > MAX_MESSAGE_SIZE) {
             lwsl_err("Sender: Received too-long msg\n");
             return -1;
         }
-        memcpy(csd->message + csd->len, in, len);
-        csd->len += len;
-        csd->message[csd->len] = '\0';
+        g_string_append_len(csd->message, in, len);
 
         if (lws_is_final_fragment(wsi)) {
-            lwsl_user("Sender: Complete message:\n%s\n", csd->message);
+            lwsl_user("Sender: Complete message:\n%s\n", csd->message->str);
 
-            if (!strncmp(csd->message, "candidate:", 10)) {
-                // We got an ICE candidate from the server (originating from the receiver)
-                const char *cand = csd->message + 10;
-                handle_remote_candidate(cand);
+            if (!strncmp(csd->message->str, "candidates:", 11)) {
+                // Batch of ICE candidates from the server (originating from the receiver)
+                candidates_for_each(csd->message->str + 11, handle_remote_candidate, NULL);
             }
-            else if (!strncmp(csd->message, "SERVER_ANSWER:", 14)) {
+            else if (!strncmp(csd->message->str, "candidate:", 10)) {
+                // Single ICE candidate (older peers)
+                const char *cand = csd->message->str + 10;
+                handle_remote_candidate(0, cand, NULL);
+            }
+            else if (!strcmp(csd->message->str, "end-of-candidates")) {
+                lwsl_user("Sender: Remote end-of-candidates\n");
+                g_signal_emit_by_name(webrtc, "add-ice-candidate", 0, "");
+            }
+            else if (!strncmp(csd->message->str, "SERVER_ANSWER:", 14)) {
                 // the Answer
-                const char *answer_sdp = csd->message + 14;
+                const char *answer_sdp = csd->message->str + 14;
                 lwsl_user("Sender: Got SDP Answer:\n%s\n", answer_sdp);
+                mark_phase(&setup.answer_us, "answer_received");
 
                 GstSDPMessage *sdp = NULL;
                 if (gst_sdp_message_new_from_text(answer_sdp, &sdp) != GST_SDP_OK) {
@@ -133,15 +849,25 @@ static int websocket_callback(struct lws *wsi, enum lws_callback_reasons reason,
                     gst_webrtc_session_description_free(answer);
                 }
             }
-            else if (!strncmp(csd->message, "SERVER_OFFER:", 13)) {
+            else if (!strncmp(csd->message->str, "select-layer:", 13)) {
+                if (simulcast_count)
+                    select_layer(csd->message->str + 13);
+                else
+                    lwsl_user("Sender: Layer selection ignored (not simulcasting)\n");
+            }
+            else if (!strcmp(csd->message->str, "send-all-layers")) {
+                if (simulcast_count)
+                    send_all_layers();
+            }
+            else if (!strncmp(csd->message->str, "SERVER_OFFER:", 13)) {
                 // it's the sender, so we ignore a re-sent Offer
                 lwsl_user("Sender: Got SERVER_OFFER from server, ignoring (we are the sender)\n");
             }
             else {
-                lwsl_user("Sender: Unknown message:\n%s\n", csd->message);
+                lwsl_user("Sender: Unknown message:\n%s\n", csd->message->str);
             }
 
-            csd->len = 0;
+            g_string_truncate(csd->message, 0);
         }
         break;
     }
@@ -150,8 +876,13 @@ static int websocket_callback(struct lws *wsi, enum lws_callback_reasons reason,
         lwsl_err("Sender: Connection error\n");
         break;
 
+    case LWS_CALLBACK_CLIENT_CLOSED:
     case LWS_CALLBACK_CLOSED:
         lwsl_user("Sender: WebSocket closed\n");
+        if (csd->message) {
+            g_string_free(csd->message, TRUE);
+            csd->message = NULL;
+        }
         break;
 
     default:
@@ -160,12 +891,66 @@ static int websocket_callback(struct lws *wsi, enum lws_callback_reasons reason,
     return 0;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    gst_init(NULL, NULL);
+    int opt;
+
+    trace_init("sender_client");
+    gst_init(&argc, &argv);
+    trace_gst_attach();
     lws_set_log_level(LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE, NULL);
 
+    while ((opt = getopt(argc, argv, "w:b:m:M:AS:EL:D:k:Uh")) != -1) {
+        switch (opt) {
+        case 'w': batch_window_ms = atoi(optarg); break;
+        case 'b': abr_kbps = atoi(optarg); break;
+        case 'm': abr_min_kbps = atoi(optarg); break;
+        case 'M': abr_max_kbps = atoi(optarg); break;
+        case 'A': abr_enabled = FALSE; break;
+        case 'S': shm_path = optarg; break;
+        case 'E': shm_encoded = TRUE; break;
+        case 'L': simulcast_count = atoi(optarg); break;
+        case 'D': dc_duration_s = atoi(optarg); break;
+        case 'k': dc_batch = atoi(optarg); break;
+        case 'U': dc_bulk_unreliable = TRUE; break;
+        default:
+            fprintf(stderr, "Usage: %s [-w candidate_batch_ms] [-b start_kbps] "
+                            "[-m min_kbps] [-M max_kbps] [-A] [-S shm_socket [-E]] [-L layers]\n"
+                            "       [-D seconds [-k batch] [-U]]\n"
+                            "  -A disables adaptive bitrate\n"
+                            "  -S also publishes frames to local consumers through shared memory\n"
+                            "  -E publishes encoded VP8 instead of raw I420 frames\n"
+                            "  -L simulcasts 2 or 3 layers (h, m, l)\n"
+                            "  -D runs the data-channel benchmark for that long\n"
+                            "  -k packs that many probe messages into one send (1-%d)\n"
+                            "  -U sends the bulk stream over an unreliable channel\n",
+                    argv[0], DC_PROBE_RATE * DC_TICK_MS / 1000);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (dc_batch < 1 || dc_batch > DC_PROBE_RATE * DC_TICK_MS / 1000) {
+        fprintf(stderr, "-k expects 1 to %d\n", DC_PROBE_RATE * DC_TICK_MS / 1000);
+        return 1;
+    }
+
+    if (simulcast_count) {
+        if (simulcast_count < 2 || simulcast_count > MAX_SIMULCAST_LAYERS) {
+            fprintf(stderr, "-L expects 2 or 3 layers\n");
+            return 1;
+        }
+        if (shm_encoded) {
+            fprintf(stderr, "-E is not supported with simulcast\n");
+            return 1;
+        }
+        // Each layer has a fixed bitrate; receivers adapt by switching layers
+        abr_enabled = FALSE;
+    }
+
     lwsl_user("Sender: Starting up...\n");
+    setup.start_us = g_get_monotonic_time();
+
+    candidate_batch = g_string_new(NULL);
 
     // LWS context
     struct lws_context_creation_info info;
@@ -177,13 +962,13 @@ int main()
             "signaling-protocol",
             websocket_callback,
             sizeof(struct client_session_data),
-            2048
+            4096
         },
         {NULL, NULL, 0, 0}
     };
     info.protocols = protocols;
 
-    struct lws_context *context = lws_create_context(&info);
+    context = lws_create_context(&info);
     if (!context) {
         lwsl_err("Sender: Failed to create LWS context\n");
         return 1;
@@ -204,16 +989,48 @@ int main()
         lws_context_destroy(context);
         return 1;
     }
+    client_wsi = wsi;
+
+    if (shm_path) {
+        if (shm_ring_create(&shm_ring, shm_path, SHM_SLOTS, SHM_SLOT_SIZE,
+                            shm_encoded ? "VP8" : "I420") < 0) {
+            lwsl_err("Sender: Failed to create shared-memory ring\n");
+            return 1;
+        }
+        lwsl_user("Sender: Publishing %s frames on %s\n",
+                  shm_encoded ? "VP8" : "I420", shm_path);
+    }
 
     // GStreamer pipeline for a test video → webrtcbin
-    GstElement *pipeline = gst_parse_launch(
-  "videotestsrc ! video/x-raw,width=640,height=480 ! videoconvert ! queue ! "
-  "vp8enc ! rtpvp8pay ! "
+    // videoscale/videorate + abrcaps let the controller change resolution and
+    // framerate; the extmap enables transport-wide congestion control feedback.
+    // With -S a tee before or after the encoder feeds the shared-memory ring;
+    // its queue leaks so a stalled ring never holds up the call.
+    gchar *launch = simulcast_count ? simulcast_launch() : g_strdup_printf(
+  "videotestsrc is-live=true ! video/x-raw,width=640,height=480,framerate=30/1 ! "
+  "videoscale ! videorate ! capsfilter name=abrcaps ! videoconvert ! %squeue ! "
+  "vp8enc name=enc deadline=1 ! %srtpvp8pay auto-header-extension=true ! "
+  "application/x-rtp,media=video,encoding-name=VP8,payload=96,"
+  "extmap-1=(string)http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01 ! "
   "webrtcbin name=webrtcbin "
   // no stun-server
-  ,
-  NULL
-);
+  "%s",
+  shm_path && !shm_encoded ? "tee name=local ! " : "",
+  shm_path && shm_encoded ? "tee name=local ! " : "",
+  !shm_path ? "" : shm_encoded ?
+      "local. ! queue leaky=downstream max-size-buffers=2 ! "
+      "appsink name=localsink sync=false max-buffers=1 drop=true" :
+      "local. ! queue leaky=downstream max-size-buffers=2 ! video/x-raw,format=I420 ! "
+      "appsink name=localsink sync=false max-buffers=1 drop=true");
+    if (simulcast_count && shm_path) {
+        gchar *with_local = g_strconcat(launch,
+            "local. ! queue leaky=downstream max-size-buffers=2 ! video/x-raw,format=I420 ! "
+            "appsink name=localsink sync=false max-buffers=1 drop=true", NULL);
+        g_free(launch);
+        launch = with_local;
+    }
+    GstElement *pipeline = gst_parse_launch(launch, NULL);
+    g_free(launch);
     if (!pipeline) {
         lwsl_err("Sender: Failed to create GStreamer pipeline\n");
         return 1;
@@ -225,16 +1042,69 @@ int main()
         return 1;
     }
 
+    if (simulcast_count) {
+        for (int i = 0; i < simulcast_count; i++) {
+            gchar *name = g_strdup_printf("valve_%s", simulcast_layers[i].rid);
+            layer_valve[i] = gst_bin_get_by_name(GST_BIN(pipeline), name);
+            g_free(name);
+            name = g_strdup_printf("pay_%s", simulcast_layers[i].rid);
+            layer_pay[i] = gst_bin_get_by_name(GST_BIN(pipeline), name);
+            g_free(name);
+            g_signal_connect(layer_pay[i], "request-extension",
+                             G_CALLBACK(on_request_extension), (gpointer)simulcast_layers[i].rid);
+        }
+        set_simulcast_preferences();
+        lwsl_user("Sender: Simulcasting %d layers, sending %s until a receiver selects\n",
+                  simulcast_count, simulcast_layers[0].rid);
+    } else {
+        encoder = gst_bin_get_by_name(GST_BIN(pipeline), "enc");
+        abr_caps = gst_bin_get_by_name(GST_BIN(pipeline), "abrcaps");
+        g_object_set(encoder, "target-bitrate", (int)(abr_kbps * 1000), NULL);
+        abr_set_level(0);
+    }
+
+    if (shm_path) {
+        GstElement *localsink = gst_bin_get_by_name(GST_BIN(pipeline), "localsink");
+        GstAppSinkCallbacks callbacks = { .new_sample = on_local_sample };
+        gst_app_sink_set_callbacks(GST_APP_SINK(localsink), &callbacks, NULL, NULL);
+        gst_object_unref(localsink);
+    }
+
     // Connect signals
+    if (abr_enabled)
+        g_signal_connect(webrtc, "request-aux-sender",
+                         G_CALLBACK(on_request_aux_sender), NULL);
+
     g_signal_connect(webrtc, "on-negotiation-needed",
                      G_CALLBACK(on_negotiation_needed), wsi);
 
     g_signal_connect(webrtc, "on-ice-candidate",
                      G_CALLBACK(on_ice_candidate), wsi);
 
+    g_signal_connect(webrtc, "notify::ice-gathering-state",
+                     G_CALLBACK(on_ice_gathering_state), NULL);
+
+    g_signal_connect(webrtc, "notify::ice-connection-state",
+                     G_CALLBACK(on_ice_connection_state), NULL);
+
+    g_signal_connect(webrtc, "notify::connection-state",
+                     G_CALLBACK(on_connection_state), NULL);
+
+    if (dc_duration_s > 0) {
+        // webrtcbin only creates data channels once it is out of NULL
+        gst_element_set_state(pipeline, GST_STATE_READY);
+        if (!setup_data_channels()) {
+            lwsl_err("Sender: Failed to create data channels\n");
+            return 1;
+        }
+    }
+
     // Start pipeline
     gst_element_set_state(pipeline, GST_STATE_PLAYING);
 
+    if (abr_enabled)
+        lws_sul_schedule(context, 0, &abr_sul, abr_poll, ABR_INTERVAL_MS * LWS_US_PER_MS);
+
     // Main loop
     while (1) {
         lws_service(context, 1000);
@@ -243,6 +1113,8 @@ int main()
     // Cleanup
     gst_element_set_state(pipeline, GST_STATE_NULL);
     gst_object_unref(pipeline);
+    if (shm_path)
+        shm_ring_destroy(&shm_ring);
     lws_context_destroy(context);
     return 0;
 }
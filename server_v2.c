@@ -1,46 +1,877 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>
+#include "handover.h"
+#include "trace.h"
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
 
-// Function to handle communication with a single client
-void *handle_client(void *client_socket) {
-    int client_fd = *(int *)client_socket;
-    free(client_socket); // Free memory allocated for the socket descriptor
-    char buffer[BUFFER_SIZE] = {0};
+// Large-message modes (-m zerocopy / -m splice) read up to this much at once
+// unless -B says otherwise
+#define LARGE_BUFFER_SIZE (256 * 1024)
 
-    printf("Client thread started.\n");
+// Read buffers are recycled through a shared pool; at most this many idle
+// buffers are kept
+#define POOL_MAX_FREE 64
+
+// Zerocopy mode: smaller sends are copied (pinning pages costs more than
+// copying them), and each connection holds at most this many buffers
+// that the kernel may still be reading from
+#define ZEROCOPY_MIN_SEND (16 * 1024)
+#define ZEROCOPY_MAX_BUFFERS 16
+#define ZEROCOPY_LINGER_MS 1000
+
+enum echo_mode { ECHO_COPY, ECHO_ZEROCOPY, ECHO_SPLICE };
+
+// Output buffer watermarks (bytes). Above HIGH we stop reading from the
+// client until the queued echo data drains below LOW.
+#define DEFAULT_HIGH_WATERMARK (64 * 1024)
+#define DEFAULT_LOW_WATERMARK  (16 * 1024)
+
+// Hot restart: a new process started with -t takes over the listening
+// socket through this Unix socket, and we drain for up to this many seconds.
+#define DEFAULT_HANDOVER_PATH "/tmp/server_v2.sock"
+#define DEFAULT_DRAIN_TIMEOUT 30
+
+// Token bucket used to rate limit reads (bytes per second).
+// A rate of 0 means unlimited. An empty bucket makes a reader wait for
+// RATE_QUANTUM bytes of tokens, whatever its read size, so large reads do
+// not turn into long stalls at low rates.
+#define RATE_QUANTUM BUFFER_SIZE
+struct token_bucket {
+    double rate;
+    double burst;
+    double tokens;
+    double last;
+    pthread_mutex_t lock;
+};
+
+// What the accept loop hands a client thread
+struct client_conn {
+    int fd;
+    int64_t accepted_us;    // trace_now_us() at accept, for tracing
+};
+
+// Runtime configuration, set from the command line
+static double client_rate = 0;
+static double client_burst = 0;
+static double global_rate = 0;
+static double global_burst = 0;
+static size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+static size_t low_watermark = DEFAULT_LOW_WATERMARK;
+static const char *handover_path = DEFAULT_HANDOVER_PATH;
+static int drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+static enum echo_mode echo_mode = ECHO_COPY;
+static size_t buffer_size = 0;   // bytes per read; 0 = mode default
+
+// Set once the listening socket has been handed to a new process; client
+// threads then close their connection after the next complete echo.
+// drain_efd becomes readable at the same time, so that threads waiting on
+// an idle connection wake up and notice.
+static volatile int draining = 0;
+static int drain_efd = -1;
+static int active_clients = 0;
+
+// Shared by all client threads
+static struct token_bucket global_bucket;
+
+// Pending echo data for one connection
+struct out_buffer {
+    char *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bucket_init(struct token_bucket *b, double rate, double burst) {
+    b->rate = rate;
+    // Default burst: one second worth of tokens, at least one quantum
+    if (burst <= 0)
+        burst = rate > RATE_QUANTUM ? rate : RATE_QUANTUM;
+    b->burst = burst;
+    b->tokens = burst;
+    b->last = now_seconds();
+    pthread_mutex_init(&b->lock, NULL);
+}
+
+// Returns the number of tokens available right now (may be negative if
+// concurrent readers overdrew the bucket). Unlimited buckets return -1.
+static double bucket_peek(struct token_bucket *b, double now) {
+    if (b->rate <= 0)
+        return -1;
+
+    pthread_mutex_lock(&b->lock);
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->last = now;
+    double tokens = b->tokens;
+    pthread_mutex_unlock(&b->lock);
+    return tokens;
+}
+
+static void bucket_consume(struct token_bucket *b, size_t n) {
+    if (b->rate <= 0)
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    b->tokens -= n;
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Milliseconds until the bucket holds `want` tokens
+static int bucket_wait_ms(const struct token_bucket *b, double tokens, double want) {
+    if (want > b->burst)
+        want = b->burst;
+    double ms = (want - tokens) / b->rate * 1000.0;
+    return ms < 1 ? 1 : (int)ms + 1;
+}
+
+// How much a connection may read right now, at most cap bytes. When the
+// answer is 0, *timeout is set to the wait until the emptier bucket refills.
+static size_t read_allowance(struct token_bucket *bucket, size_t cap, int *timeout) {
+    double now = now_seconds();
+    double ct = bucket_peek(bucket, now);
+    double gt = bucket_peek(&global_bucket, now);
+    size_t allowance = cap;
+
+    if (ct >= 0 && ct < allowance)
+        allowance = ct > 0 ? (size_t)ct : 0;
+    if (gt >= 0 && gt < allowance)
+        allowance = gt > 0 ? (size_t)gt : 0;
+
+    if (allowance == 0) {
+        int cw = ct >= 0 ? bucket_wait_ms(bucket, ct, RATE_QUANTUM) : 0;
+        int gw = gt >= 0 ? bucket_wait_ms(&global_bucket, gt, RATE_QUANTUM) : 0;
+        *timeout = cw > gw ? cw : gw;
+    }
+    return allowance;
+}
+
+static void consume_tokens(struct token_bucket *bucket, size_t n) {
+    bucket_consume(bucket, n);
+    bucket_consume(&global_bucket, n);
+}
+
+// A read buffer of buffer_size bytes. While its data is being echoed it
+// also records how much has been sent and, in zerocopy mode, the ids of
+// the zerocopy sends that used it. A buffer is sent before the next one,
+// so its ids are consecutive.
+struct pool_buf {
+    struct pool_buf *next;
+    char *data;
+    size_t len;
+    size_t sent;
+    uint32_t first_id;
+    uint32_t last_id;
+    uint32_t zc_pending;    // zerocopy sends not completed yet
+    int zerocopy;
+};
+
+static struct pool_buf *pool_free = NULL;
+static int pool_free_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Zerocopy buffers whose completion never arrived. The kernel may still
+// send from their pages, so they are leaked on purpose and only counted.
+static unsigned long zc_leaked = 0;
+
+static struct pool_buf *pool_get(void) {
+    struct pool_buf *b;
+
+    pthread_mutex_lock(&pool_lock);
+    if ((b = pool_free)) {
+        pool_free = b->next;
+        pool_free_count--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!b) {
+        // Page aligned, so a zerocopy send pins as few pages as possible
+        if (!(b = malloc(sizeof(*b))))
+            return NULL;
+        if (posix_memalign((void **)&b->data, 4096, buffer_size)) {
+            free(b);
+            return NULL;
+        }
+    }
+    b->next = NULL;
+    b->len = b->sent = 0;
+    b->first_id = b->last_id = 0;
+    b->zc_pending = 0;
+    b->zerocopy = 0;
+    return b;
+}
+
+static void pool_discard(struct pool_buf *b) {
+    free(b->data);
+    free(b);
+}
+
+static void pool_put(struct pool_buf *b) {
+    pthread_mutex_lock(&pool_lock);
+    if (pool_free_count < POOL_MAX_FREE) {
+        b->next = pool_free;
+        pool_free = b;
+        pool_free_count++;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (b)
+        pool_discard(b);
+}
+
+// poll() for one client socket that also returns when draining starts
+static int poll_client(struct pollfd *pfd, int timeout) {
+    struct pollfd fds[2] = { *pfd, { .fd = drain_efd, .events = POLLIN } };
+    int n = poll(fds, draining || drain_efd < 0 ? 1 : 2, timeout);
+
+    pfd->revents = fds[0].revents;
+    return n;
+}
+
+// Append data to the output buffer, compacting or growing it as needed
+static int out_buffer_append(struct out_buffer *ob, const char *data, size_t n) {
+    if (ob->start + ob->len + n > ob->cap) {
+        if (ob->start > 0) {
+            memmove(ob->data, ob->data + ob->start, ob->len);
+            ob->start = 0;
+        }
+        if (ob->len + n > ob->cap) {
+            size_t new_cap = ob->cap ? ob->cap : BUFFER_SIZE;
+            while (new_cap < ob->len + n)
+                new_cap *= 2;
+            char *p = realloc(ob->data, new_cap);
+            if (!p)
+                return -1;
+            ob->data = p;
+            ob->cap = new_cap;
+        }
+    }
+    memcpy(ob->data + ob->start + ob->len, data, n);
+    ob->len += n;
+    return 0;
+}
+
+// Write as much pending data as the socket accepts without blocking.
+// Returns -1 on a fatal socket error.
+static int out_buffer_flush(struct out_buffer *ob, int fd) {
+    while (ob->len > 0) {
+        ssize_t sent = send(fd, ob->data + ob->start, ob->len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        ob->start += sent;
+        ob->len -= sent;
+    }
+    ob->start = 0;
+    return 0;
+}
+
+// Echo through a user-space buffer and the output buffer
+static void echo_copy(int client_fd, struct token_bucket *bucket, int64_t accepted_us) {
+    struct pool_buf *read_buf = pool_get();
+    char *buffer;
+    int first_read = 1;
+    struct out_buffer out = {0};
+    int reading_paused = 0;
+
+    if (!read_buf) {
+        perror("Buffer allocation failed");
+        return;
+    }
+    buffer = read_buf->data;
 
     // Exchange messages in a loop
     while (1) {
-        // Read message from the client
-        ssize_t bytes_read = read(client_fd, buffer, BUFFER_SIZE);
-        if (bytes_read <= 0) {
+        struct pollfd pfd = { .fd = client_fd, .events = 0 };
+        int timeout = -1;
+        size_t allowance = 0;
+
+        if (!reading_paused) {
+            // Read no more than both buckets currently allow; when out of
+            // tokens, sleep until the emptier bucket refills
+            allowance = read_allowance(bucket, buffer_size, &timeout);
+            if (allowance > 0)
+                pfd.events |= POLLIN;
+        }
+        if (out.len > 0)
+            pfd.events |= POLLOUT;
+
+        if (poll_client(&pfd, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Poll failed");
+            break;
+        }
+
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            printf("Client disconnected.\n");
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            if (out_buffer_flush(&out, client_fd) < 0) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            if (reading_paused && out.len <= low_watermark) {
+                printf("Client caught up, resuming reads.\n");
+                reading_paused = 0;
+            }
+        }
+
+        if ((pfd.events & POLLIN) && (pfd.revents & (POLLIN | POLLHUP))) {
+            // Read message from the client
+            int64_t read_us = trace_now_us();
+            ssize_t bytes_read = read(client_fd, buffer, allowance);
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (bytes_read <= 0) {
+                printf("Client disconnected.\n");
+                break;
+            }
+
+            if (first_read) {
+                TRACE_SPAN(echo_accept_to_first_byte, "echo", accepted_us);
+                first_read = 0;
+            }
+
+            consume_tokens(bucket, bytes_read);
+
+            // Large reads (-B) are not printed
+            if (bytes_read <= BUFFER_SIZE)
+                printf("Message from client: %.*s\n", (int)bytes_read, buffer);
+
+            // Queue the response and try to send it right away
+            if (out_buffer_append(&out, buffer, bytes_read) < 0 ||
+                out_buffer_flush(&out, client_fd) < 0) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            if (bytes_read <= BUFFER_SIZE)
+                printf("Message echoed to client: %.*s\n", (int)bytes_read, buffer);
+            TRACE_SPAN(echo_read_to_send, "echo", read_us);
+
+            if (out.len >= high_watermark) {
+                printf("Client is slow (%zu bytes pending), pausing reads.\n", out.len);
+                reading_paused = 1;
+            }
+        }
+
+        if (draining && out.len == 0) {
+            printf("Closing client after response (draining).\n");
+            break;
+        }
+    }
+
+    free(out.data);
+    pool_put(read_buf);
+}
+
+// Zerocopy mode state for one connection. Buffers move from unsent to
+// inflight once fully passed to send(), and back to the pool when the
+// kernel reports (on the socket's error queue) that it is done with them.
+struct zc_conn {
+    struct pool_buf *unsent_head, *unsent_tail;
+    struct pool_buf *inflight_head, *inflight_tail;
+    size_t unsent_bytes;
+    int held;
+    uint32_t next_id;       // id of the next zerocopy send
+    unsigned long sends;
+    unsigned long copied;   // completions where the kernel copied anyway
+};
+
+static void zc_push(struct pool_buf **head, struct pool_buf **tail, struct pool_buf *b) {
+    b->next = NULL;
+    if (*tail)
+        (*tail)->next = b;
+    else
+        *head = b;
+    *tail = b;
+}
+
+static struct pool_buf *zc_pop(struct pool_buf **head, struct pool_buf **tail) {
+    struct pool_buf *b = *head;
+    if ((*head = b->next) == NULL)
+        *tail = NULL;
+    return b;
+}
+
+// Send as much unsent data as the socket accepts without blocking.
+// Returns -1 on a fatal socket error.
+static int zc_flush(int fd, struct zc_conn *c) {
+    int allow_zerocopy = 1;
+
+    while (c->unsent_head) {
+        struct pool_buf *b = c->unsent_head;
+        size_t n = b->len - b->sent;
+        int zerocopy = allow_zerocopy && n >= ZEROCOPY_MIN_SEND;
+        ssize_t sent = send(fd, b->data + b->sent, n,
+                            MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == ENOBUFS && zerocopy) {
+                // Out of optmem for pinned pages: copy until completions free some
+                allow_zerocopy = 0;
+                continue;
+            }
+            return -1;
+        }
+        if (zerocopy) {
+            if (!b->zerocopy)
+                b->first_id = c->next_id;
+            b->last_id = c->next_id++;
+            b->zc_pending++;
+            b->zerocopy = 1;
+            c->sends++;
+        }
+        b->sent += sent;
+        c->unsent_bytes -= sent;
+
+        if (b->sent == b->len) {
+            zc_pop(&c->unsent_head, &c->unsent_tail);
+            if (b->zerocopy) {
+                zc_push(&c->inflight_head, &c->inflight_tail, b);
+            } else {
+                pool_put(b);
+                c->held--;
+            }
+        }
+    }
+    return 0;
+}
+
+// Sends lo..hi have completed: count those that belong to b
+static void zc_complete(struct pool_buf *b, uint32_t lo, uint32_t hi) {
+    if (!b->zerocopy)
+        return;
+    if ((int32_t)(b->first_id - lo) > 0)
+        lo = b->first_id;
+    if ((int32_t)(b->last_id - hi) < 0)
+        hi = b->last_id;
+    if ((int32_t)(hi - lo) >= 0)
+        b->zc_pending -= hi - lo + 1;
+}
+
+// Read zerocopy completions from the error queue and recycle the buffers
+// they release. Completions may arrive out of order, so each reported
+// range is applied to the buffers it covers, and a buffer is recycled once
+// all of its sends have completed. Returns -1 if the queue holds a real
+// socket error.
+static int zc_reap(int fd, struct zc_conn *c) {
+    char control[128];
+
+    while (1) {
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        struct cmsghdr *cm;
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                errno = serr->ee_errno;
+                return -1;
+            }
+            // Sends ee_info..ee_data are done with their pages. Only the
+            // head of the unsent list can have sends of its own.
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                c->copied += serr->ee_data - serr->ee_info + 1;
+            for (struct pool_buf *b = c->inflight_head; b; b = b->next)
+                zc_complete(b, serr->ee_info, serr->ee_data);
+            if (c->unsent_head)
+                zc_complete(c->unsent_head, serr->ee_info, serr->ee_data);
+        }
+    }
+
+    struct pool_buf **pp = &c->inflight_head, *prev = NULL;
+    while (*pp) {
+        struct pool_buf *b = *pp;
+        if (b->zc_pending) {
+            prev = b;
+            pp = &b->next;
+            continue;
+        }
+        *pp = b->next;
+        if (c->inflight_tail == b)
+            c->inflight_tail = prev;
+        pool_put(b);
+        c->held--;
+    }
+
+    // Nothing (more) queued: POLLERR may still mean the connection failed
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Echo with MSG_ZEROCOPY sends straight from the pooled read buffers
+static void echo_zerocopy(int client_fd, struct token_bucket *bucket, int64_t accepted_us) {
+    struct zc_conn c = {0};
+    int one = 1, first_read = 1, reading_paused = 0;
+    unsigned long long echoed = 0;
+
+    if (setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        perror("SO_ZEROCOPY unavailable, copying instead");
+        echo_copy(client_fd, bucket, accepted_us);
+        return;
+    }
+
+    while (1) {
+        struct pollfd pfd = { .fd = client_fd, .events = 0 };
+        int timeout = -1;
+        size_t allowance = 0;
+
+        // Completions arrive as POLLERR, which poll always reports, so it is
+        // safe to wait with neither POLLIN nor POLLOUT while all buffers are held
+        if (!reading_paused && c.held < ZEROCOPY_MAX_BUFFERS) {
+            allowance = read_allowance(bucket, buffer_size, &timeout);
+            if (allowance > 0)
+                pfd.events |= POLLIN;
+        }
+        if (c.unsent_head)
+            pfd.events |= POLLOUT;
+
+        if (poll_client(&pfd, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Poll failed");
+            break;
+        }
+
+        if (pfd.revents & POLLNVAL)
+            break;
+        if ((pfd.revents & POLLERR) && zc_reap(client_fd, &c) < 0) {
+            printf("Client disconnected.\n");
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            if (zc_flush(client_fd, &c) < 0) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            if (reading_paused && c.unsent_bytes <= low_watermark)
+                reading_paused = 0;
+        }
+
+        if ((pfd.events & POLLIN) && (pfd.revents & (POLLIN | POLLHUP))) {
+            int64_t read_us = trace_now_us();
+            struct pool_buf *b = pool_get();
+            if (!b) {
+                perror("Buffer allocation failed");
+                break;
+            }
+            ssize_t bytes_read = read(client_fd, b->data, allowance);
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                pool_put(b);
+                continue;
+            }
+            if (bytes_read <= 0) {
+                pool_put(b);
+                printf("Client disconnected.\n");
+                break;
+            }
+
+            if (first_read) {
+                TRACE_SPAN(echo_accept_to_first_byte, "echo", accepted_us);
+                first_read = 0;
+            }
+            consume_tokens(bucket, bytes_read);
+
+            b->len = bytes_read;
+            zc_push(&c.unsent_head, &c.unsent_tail, b);
+            c.unsent_bytes += bytes_read;
+            c.held++;
+            echoed += bytes_read;
+
+            if (zc_flush(client_fd, &c) < 0) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            TRACE_SPAN(echo_read_to_send, "echo", read_us);
+
+            if (c.unsent_bytes >= high_watermark)
+                reading_paused = 1;
+        }
+
+        if (draining && !c.unsent_head) {
+            printf("Closing client after response (draining).\n");
+            break;
+        }
+    }
+
+    // The kernel may still read from in-flight buffers (retransmits), so
+    // wait a little for their completions. Buffers still in flight after
+    // that are leaked: freeing them would let malloc hand their pages to
+    // another connection while a retransmit can still send from them.
+    for (int waited = 0; c.inflight_head && waited < ZEROCOPY_LINGER_MS; waited += 10) {
+        struct pollfd pfd = { .fd = client_fd, .events = 0 };
+        poll(&pfd, 1, 10);
+        if (zc_reap(client_fd, &c) < 0)
+            break;
+    }
+    unsigned long leaked = 0;
+    while (c.inflight_head) {
+        zc_pop(&c.inflight_head, &c.inflight_tail);
+        leaked++;
+    }
+    // Fully unsent buffers were never handed to the kernel; a partly sent
+    // one may have sends in flight too
+    while (c.unsent_head) {
+        struct pool_buf *b = zc_pop(&c.unsent_head, &c.unsent_tail);
+        if (b->zc_pending)
+            leaked++;
+        else
+            pool_put(b);
+    }
+    if (leaked) {
+        pthread_mutex_lock(&pool_lock);
+        zc_leaked += leaked;
+        leaked = zc_leaked;
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    printf("Echoed %llu bytes: %lu zerocopy sends, %lu copied by the kernel.\n",
+           echoed, c.sends, c.copied);
+    if (leaked)
+        printf("Zerocopy completions missing, %lu buffers leaked so far.\n", leaked);
+}
+
+// Echo by splicing socket -> pipe -> socket; the data never enters user space.
+// The pipe is the output buffer, so it bounds what is pending for a slow reader.
+static void echo_splice(int client_fd, struct token_bucket *bucket, int64_t accepted_us) {
+    int pipefd[2], first_read = 1, pipe_full = 0;
+    size_t in_pipe = 0, pipe_size;
+    unsigned long long echoed = 0;
+
+    if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("Pipe creation failed");
+        return;
+    }
+    // Best effort: capped by /proc/sys/fs/pipe-max-size
+    fcntl(pipefd[1], F_SETPIPE_SZ, (int)buffer_size);
+    pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+
+    while (1) {
+        struct pollfd pfd = { .fd = client_fd, .events = 0 };
+        int timeout = -1;
+        size_t allowance = 0;
+        int64_t read_us = 0;
+
+        if (!pipe_full && in_pipe < pipe_size) {
+            allowance = read_allowance(bucket, pipe_size - in_pipe, &timeout);
+            if (allowance > 0)
+                pfd.events |= POLLIN;
+        }
+        if (in_pipe > 0)
+            pfd.events |= POLLOUT;
+
+        if (poll_client(&pfd, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Poll failed");
+            break;
+        }
+
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
             printf("Client disconnected.\n");
             break;
         }
 
-        printf("Message from client: %s\n", buffer);
+        if ((pfd.events & POLLIN) && (pfd.revents & (POLLIN | POLLHUP))) {
+            read_us = trace_now_us();
+            ssize_t n = splice(client_fd, NULL, pipefd[1], NULL, allowance,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EAGAIN) {
+                // Socket data is spread over more pipe slots than bytes
+                // suggest; wait for the pipe to drain before reading more
+                pipe_full = in_pipe > 0;
+                read_us = 0;
+            } else if (n < 0 && errno == EINTR) {
+                read_us = 0;
+            } else if (n <= 0) {
+                printf("Client disconnected.\n");
+                break;
+            } else {
+                if (first_read) {
+                    TRACE_SPAN(echo_accept_to_first_byte, "echo", accepted_us);
+                    first_read = 0;
+                }
+                consume_tokens(bucket, n);
+                in_pipe += n;
+            }
+        }
+
+        if (in_pipe > 0) {
+            ssize_t n = splice(pipefd[0], NULL, client_fd, NULL, in_pipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            if (n > 0) {
+                in_pipe -= n;
+                echoed += n;
+                pipe_full = 0;
+            }
+        }
+        if (read_us)
+            TRACE_SPAN(echo_read_to_send, "echo", read_us);
 
-        // Send a response back to the client
-        send(client_fd, buffer, bytes_read, 0);
-        printf("Message echoed to client: %s\n", buffer);
+        if (draining && in_pipe == 0) {
+            printf("Closing client after response (draining).\n");
+            break;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    printf("Echoed %llu bytes through a %zu-byte pipe.\n", echoed, pipe_size);
+}
+
+// Function to handle communication with a single client
+void *handle_client(void *client_socket) {
+    struct client_conn *conn = client_socket;
+    int client_fd = conn->fd;
+    int64_t accepted_us = conn->accepted_us;
+    free(conn); // Free memory allocated for the connection
+    struct token_bucket bucket;
+
+    bucket_init(&bucket, client_rate, client_burst);
+
+    // Non-blocking so a slow reader can never stall this thread in send()
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    // An echo is written in read-sized pieces; without TCP_NODELAY every
+    // piece after the first waits for the peer's delayed ACK
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    printf("Client thread started.\n");
+
+    switch (echo_mode) {
+    case ECHO_COPY: echo_copy(client_fd, &bucket, accepted_us); break;
+    case ECHO_ZEROCOPY: echo_zerocopy(client_fd, &bucket, accepted_us); break;
+    case ECHO_SPLICE: echo_splice(client_fd, &bucket, accepted_us); break;
     }
 
     // Close the client connection
     close(client_fd);
+    pthread_mutex_destroy(&bucket.lock);
+    __atomic_sub_fetch(&active_clients, 1, __ATOMIC_SEQ_CST);
     return NULL;
 }
 
-int main() {
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-r client_rate] [-b client_burst] [-g global_rate] [-G global_burst]\n"
+            "          [-H high_watermark] [-L low_watermark]\n"
+            "          [-m copy|zerocopy|splice] [-B read_size]\n"
+            "          [-s handover_socket] [-t] [-d drain_seconds]\n"
+            "  Rates are in bytes/second (0 = unlimited), bursts and watermarks in bytes.\n"
+            "  -t takes over the listening socket from the running server at -s.\n"
+            "  -m zerocopy sends with MSG_ZEROCOPY, -m splice echoes through a pipe;\n"
+            "  both read up to %d bytes at once unless -B is given.\n",
+            prog, LARGE_BUFFER_SIZE);
+}
+
+int main(int argc, char *argv[]) {
     int server_fd, new_client_fd;
     struct sockaddr_in server_addr, client_addr;
     socklen_t addr_len = sizeof(client_addr);
+    int handover_fd, takeover = 0;
+    int opt;
+
+    trace_init("server_v2");
+
+    while ((opt = getopt(argc, argv, "r:b:g:G:H:L:s:td:m:B:h")) != -1) {
+        switch (opt) {
+        case 'r': client_rate = atof(optarg); break;
+        case 'b': client_burst = atof(optarg); break;
+        case 'g': global_rate = atof(optarg); break;
+        case 'G': global_burst = atof(optarg); break;
+        case 'H': high_watermark = strtoul(optarg, NULL, 10); break;
+        case 'L': low_watermark = strtoul(optarg, NULL, 10); break;
+        case 's': handover_path = optarg; break;
+        case 't': takeover = 1; break;
+        case 'd': drain_timeout = atoi(optarg); break;
+        case 'm':
+            if (!strcmp(optarg, "copy"))
+                echo_mode = ECHO_COPY;
+            else if (!strcmp(optarg, "zerocopy"))
+                echo_mode = ECHO_ZEROCOPY;
+            else if (!strcmp(optarg, "splice"))
+                echo_mode = ECHO_SPLICE;
+            else {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B': buffer_size = strtoul(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (low_watermark > high_watermark) {
+        fprintf(stderr, "Low watermark must not exceed high watermark\n");
+        exit(EXIT_FAILURE);
+    }
+    if (buffer_size == 0)
+        buffer_size = echo_mode == ECHO_COPY ? BUFFER_SIZE : LARGE_BUFFER_SIZE;
+
+    bucket_init(&global_bucket, global_rate, global_burst);
+
+    if (takeover) {
+        // Inherit the listening socket from the running server
+        int conn;
+        if (handover_receive(handover_path, &server_fd, 1, &conn) != 1) {
+            fprintf(stderr, "Takeover from %s failed\n", handover_path);
+            exit(EXIT_FAILURE);
+        }
+        handover_ack(conn);
+        printf("Took over listening socket from previous server.\n");
+        goto listening;
+    }
 
     // Create server socket
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -66,9 +897,49 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    printf("Server is listening on port %d...\n", PORT);
+listening:
+    if ((drain_efd = eventfd(0, EFD_CLOEXEC)) < 0)
+        perror("Drain eventfd failed, idle clients close at the drain timeout");
+
+    // Accept future takeover requests
+    if ((handover_fd = handover_listen(handover_path)) < 0)
+        fprintf(stderr, "Hot restart disabled\n");
+
+    printf("Server is listening on port %d (%s echo, %zu-byte reads)...\n", PORT,
+           echo_mode == ECHO_ZEROCOPY ? "zerocopy" : echo_mode == ECHO_SPLICE ? "splice" : "copy",
+           buffer_size);
+    if (client_rate > 0 || global_rate > 0)
+        printf("Rate limits: %.0f B/s per client, %.0f B/s global (0 = unlimited)\n",
+               client_rate, global_rate);
 
     while (1) {
+        struct pollfd pfds[2] = {
+            { .fd = server_fd, .events = POLLIN },
+            { .fd = handover_fd, .events = POLLIN },
+        };
+
+        if (poll(pfds, handover_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno != EINTR)
+                perror("Poll failed");
+            continue;
+        }
+
+        if (handover_fd >= 0 && (pfds[1].revents & POLLIN)) {
+            // A new server wants our listening socket
+            if (handover_send(handover_fd, &server_fd, 1) == 0) {
+                printf("Listening socket handed over, draining %d clients...\n",
+                       __atomic_load_n(&active_clients, __ATOMIC_SEQ_CST));
+                draining = 1;
+                if (drain_efd >= 0)
+                    eventfd_write(drain_efd, 1);
+                break;
+            }
+            continue;
+        }
+
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+
         // Accept a new client connection
         if ((new_client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len)) < 0) {
             perror("Accept failed");
@@ -77,23 +948,36 @@ int main() {
 
         printf("Client connected.\n");
 
-        // Allocate memory for the client socket descriptor
-        int *client_socket = malloc(sizeof(int));
-        *client_socket = new_client_fd;
+        // Allocate memory for the client connection
+        struct client_conn *client_socket = malloc(sizeof(*client_socket));
+        client_socket->fd = new_client_fd;
+        client_socket->accepted_us = trace_now_us();
 
         // Create a new thread to handle the client
         pthread_t thread_id;
+        __atomic_add_fetch(&active_clients, 1, __ATOMIC_SEQ_CST);
         if (pthread_create(&thread_id, NULL, handle_client, client_socket) != 0) {
             perror("Failed to create thread");
             close(new_client_fd);
             free(client_socket);
+            __atomic_sub_fetch(&active_clients, 1, __ATOMIC_SEQ_CST);
         } else {
             pthread_detach(thread_id); // Detach the thread to handle cleanup automatically
         }
     }
 
-    // Close the server socket
+    // Close the server socket; the new process keeps its own copy
     close(server_fd);
+    close(handover_fd);
+
+    // Let existing connections finish before exiting
+    for (int waited = 0; waited < drain_timeout * 10; waited++) {
+        if (__atomic_load_n(&active_clients, __ATOMIC_SEQ_CST) == 0)
+            break;
+        usleep(100 * 1000);
+    }
+    printf("Drain complete (%d clients remaining), exiting.\n",
+           __atomic_load_n(&active_clients, __ATOMIC_SEQ_CST));
 
     return 0;
-}
\ No newline at end of file
+}
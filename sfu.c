@@ -0,0 +1,1003 @@
+#include <libwebsockets.h>
+#include <gst/gst.h>
+#include <gst/webrtc/webrtc.h>
+#include <gst/rtp/rtp.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "candidates.h"
+
+// Selective forwarding unit.
+//
+// Registers with the signaling server as "sfu", answers the publisher's
+// Offer with its own webrtcbin, and offers the publisher's RTP to every
+// other client through one webrtcbin per subscriber. Packets go
+// publisher webrtcbin -> rtpssrcdemux -> tee -> queue -> subscriber
+// webrtcbin; they are never depayloaded or decoded, so the cost per viewer
+// is SRTP and packet handling only.
+//
+// Simulcast: the publisher sends every layer, each with its own SSRC and
+// RID. Each RID gets its own tee ("" when the publisher does not simulcast)
+// and every subscriber is linked to the one it picked with
+// "select-layer:<rid>". Its SSRC, sequence numbers and timestamps are
+// rewritten, so a layer switch looks like one continuous stream to it.
+
+// Forwarding latency: small jitter buffer on the publisher side, and a
+// leaky queue per subscriber so one slow subscriber cannot stall the tee
+#define PUBLISHER_JITTER_MS 50
+#define SUBSCRIBER_QUEUE_MS 200
+
+#define RTP_RID_URI "urn:ietf:params:rtp-hdrext:sdes:rtp-stream-id"
+#define SWITCH_TS_STEP 3000   // timestamp gap across a layer switch (one frame at 30 fps)
+
+// What a subscriber's forwarding probe rewrites; only touched from its
+// queue's streaming thread
+struct forward_state {
+    gboolean started;
+    gboolean caps_sent;
+    guint32 in_ssrc;      // layer currently forwarded
+    guint32 out_ssrc;     // what the subscriber sees, whatever the layer
+    guint16 seq_offset;
+    guint32 ts_offset;
+    guint16 last_seq;
+    guint32 last_ts;
+};
+
+// Local ICE candidates of each peer connection are collected for this long
+// and sent as one message, as the clients do
+#define BATCH_WINDOW_MS 20
+
+struct peer {
+    int id;
+    gboolean publisher;
+    GstElement *webrtc;   // NULL for subscribers waiting for media
+    GstElement *queue;
+    GstElement *tee;      // the layer this subscriber is linked to
+    GstPad *tee_pad;
+    gchar *rid;           // layer asked for, NULL for the default
+    struct forward_state fwd;
+    GPtrArray *demuxes;   // publisher: one rtpssrcdemux per webrtcbin pad
+};
+
+// Passed to create-offer/create-answer promises
+struct sdp_ctx {
+    int id;
+    GstElement *webrtc;
+};
+
+static struct lws_context *context = NULL;
+static struct lws *client_wsi = NULL;
+static GstElement *pipeline = NULL;
+
+// Layer tees by RID. They outlive publishers, so subscribers stay linked
+// when the publisher reconnects. layers_lock also guards publisher_rids,
+// rid_ext_id and the publisher's demuxes: streaming threads read them.
+static GMutex layers_lock;
+static GHashTable *layer_tees = NULL;   // rid -> tee
+static GPtrArray *publisher_rids = NULL;   // a=rid of the current Offer, best first
+static gint rid_ext_id = 0;               // RID header extension id, 0 = none
+
+// Only touched from the lws service thread
+static GHashTable *peers = NULL;   // id -> struct peer *
+static struct peer *publisher = NULL;
+
+// Set from the streaming thread once the publisher's caps are known
+static GMutex caps_lock;
+static GstCaps *stream_caps = NULL;
+static gint media_ready = 0;
+
+// Outgoing signaling messages, written from the lws service thread
+static GMutex outbox_lock;
+static GQueue outbox = G_QUEUE_INIT;
+
+// Candidate batches, guarded by outbox_lock
+struct candidate_batch {
+    GString *lines;       // "<mlineindex> <candidate>\n" lines
+    gboolean done;        // end-of-candidates still to send
+};
+static GHashTable *candidate_batches = NULL;   // id -> struct candidate_batch *
+static gboolean candidates_pending = FALSE;    // lines or end-of-candidates queued
+static gboolean batch_scheduled = FALSE;
+static lws_sorted_usec_list_t batch_sul;
+
+// Upper bound on one assembled message from the signaling server
+#define MAX_MESSAGE_SIZE (1024 * 1024)
+
+struct client_session_data {
+    GString *message;     // assembled from fragments, up to MAX_MESSAGE_SIZE
+};
+
+/* Queue a message for the server (takes ownership of msg) */
+static void queue_message(gchar *msg)
+{
+    g_mutex_lock(&outbox_lock);
+    g_queue_push_tail(&outbox, msg);
+    g_mutex_unlock(&outbox_lock);
+    lws_cancel_service(context);
+}
+
+static void sdp_ctx_free(gpointer data)
+{
+    struct sdp_ctx *ctx = data;
+    gst_object_unref(ctx->webrtc);
+    g_free(ctx);
+}
+
+static struct sdp_ctx *sdp_ctx_new(struct peer *p)
+{
+    struct sdp_ctx *ctx = g_new0(struct sdp_ctx, 1);
+    ctx->id = p->id;
+    ctx->webrtc = gst_object_ref(p->webrtc);
+    return ctx;
+}
+
+static void candidate_batch_free(gpointer data)
+{
+    struct candidate_batch *b = data;
+    g_string_free(b->lines, TRUE);
+    g_free(b);
+}
+
+/* The batch for one peer connection; called with outbox_lock held */
+static struct candidate_batch *candidate_batch_for(int id)
+{
+    struct candidate_batch *b = g_hash_table_lookup(candidate_batches, GINT_TO_POINTER(id));
+    if (!b) {
+        b = g_new0(struct candidate_batch, 1);
+        b->lines = g_string_new(NULL);
+        g_hash_table_insert(candidate_batches, GINT_TO_POINTER(id), b);
+    }
+    return b;
+}
+
+/* Batch window elapsed: one candidates: message (and end-of-candidates) per peer */
+static void flush_candidate_batches(lws_sorted_usec_list_t *sul)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_mutex_lock(&outbox_lock);
+    g_hash_table_iter_init(&iter, candidate_batches);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct candidate_batch *b = value;
+        int id = GPOINTER_TO_INT(key);
+
+        if (b->lines->len > 0) {
+            g_queue_push_tail(&outbox, g_strdup_printf("to:%d:" CANDIDATES_PREFIX "%s",
+                                                       id, b->lines->str));
+            g_string_truncate(b->lines, 0);
+        }
+        if (b->done) {
+            g_queue_push_tail(&outbox, g_strdup_printf("to:%d:end-of-candidates", id));
+            b->done = FALSE;
+        }
+    }
+    candidates_pending = FALSE;
+    batch_scheduled = FALSE;
+    g_mutex_unlock(&outbox_lock);
+
+    lws_callback_on_writable(client_wsi);
+}
+
+/* Local ICE candidate for one of our peer connections */
+static void on_ice_candidate(GstElement *webrtcbin, guint mlineindex,
+                             gchar *candidate, gpointer user_data)
+{
+    int id = GPOINTER_TO_INT(user_data);
+    gchar *route = g_strdup_printf("to:%d:", id);
+
+    g_mutex_lock(&outbox_lock);
+    candidates_batch_add(candidate_batch_for(id)->lines, &outbox, route, mlineindex, candidate);
+    candidates_pending = TRUE;
+    g_mutex_unlock(&outbox_lock);
+    lws_cancel_service(context);
+    g_free(route);
+}
+
+/* Gathering finished for one peer connection */
+static void on_ice_gathering_state(GstElement *webrtcbin, GParamSpec *pspec,
+                                   gpointer user_data)
+{
+    GstWebRTCICEGatheringState state;
+    g_object_get(webrtcbin, "ice-gathering-state", &state, NULL);
+
+    if (state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE) {
+        g_mutex_lock(&outbox_lock);
+        candidate_batch_for(GPOINTER_TO_INT(user_data))->done = TRUE;
+        candidates_pending = TRUE;
+        g_mutex_unlock(&outbox_lock);
+        lws_cancel_service(context);
+    }
+}
+
+/* Answer for the publisher is ready */
+static void on_answer_created(GstPromise *promise, gpointer user_data)
+{
+    struct sdp_ctx *ctx = user_data;
+    GstWebRTCSessionDescription *answer = NULL;
+
+    gst_promise_wait(promise);
+    gst_structure_get(gst_promise_get_reply(promise), "answer",
+                      GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, NULL);
+    gst_promise_unref(promise);
+    if (!answer) {
+        lwsl_err("[SFU] Failed to create Answer for publisher %d\n", ctx->id);
+        return;
+    }
+
+    g_signal_emit_by_name(ctx->webrtc, "set-local-description", answer, NULL);
+    gchar *sdp_text = gst_sdp_message_as_text(answer->sdp);
+    gst_webrtc_session_description_free(answer);
+
+    lwsl_user("[SFU] Sending Answer to publisher %d\n", ctx->id);
+    queue_message(g_strdup_printf("to:%d:SERVER_ANSWER:%s", ctx->id, sdp_text));
+    g_free(sdp_text);
+}
+
+/* Offer for a subscriber is ready */
+static void on_offer_created(GstPromise *promise, gpointer user_data)
+{
+    struct sdp_ctx *ctx = user_data;
+    GstWebRTCSessionDescription *offer = NULL;
+
+    gst_promise_wait(promise);
+    gst_structure_get(gst_promise_get_reply(promise), "offer",
+                      GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, NULL);
+    gst_promise_unref(promise);
+    if (!offer) {
+        lwsl_err("[SFU] Failed to create Offer for subscriber %d\n", ctx->id);
+        return;
+    }
+
+    g_signal_emit_by_name(ctx->webrtc, "set-local-description", offer, NULL);
+    gchar *sdp_text = gst_sdp_message_as_text(offer->sdp);
+    gst_webrtc_session_description_free(offer);
+
+    lwsl_user("[SFU] Sending Offer to subscriber %d\n", ctx->id);
+    queue_message(g_strdup_printf("to:%d:SERVER_OFFER:%s", ctx->id, sdp_text));
+    g_free(sdp_text);
+}
+
+static void on_negotiation_needed(GstElement *webrtcbin, gpointer user_data)
+{
+    struct sdp_ctx *ctx = g_new0(struct sdp_ctx, 1);
+    ctx->id = GPOINTER_TO_INT(user_data);
+    ctx->webrtc = gst_object_ref(webrtcbin);
+
+    GstPromise *promise = gst_promise_new_with_change_func(on_offer_created, ctx, sdp_ctx_free);
+    g_signal_emit_by_name(webrtcbin, "create-offer", NULL, promise);
+}
+
+static GstPadProbeReturn on_stream_caps(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+
+/* The tee for a layer, created on first use */
+static GstElement *layer_tee(const char *rid)
+{
+    GstElement *tee;
+
+    g_mutex_lock(&layers_lock);
+    tee = g_hash_table_lookup(layer_tees, rid);
+    if (!tee) {
+        tee = gst_element_factory_make("tee", NULL);
+        g_object_set(tee, "allow-not-linked", TRUE, NULL);
+        gst_bin_add(GST_BIN(pipeline), tee);
+        GstPad *tee_sink = gst_element_get_static_pad(tee, "sink");
+        gst_pad_add_probe(tee_sink, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, on_stream_caps, NULL, NULL);
+        gst_object_unref(tee_sink);
+        gst_element_sync_state_with_parent(tee);
+        g_hash_table_insert(layer_tees, g_strdup(rid), tee);
+    }
+    g_mutex_unlock(&layers_lock);
+    return tee;
+}
+
+/* Whether the current publisher sends this layer */
+static gboolean layer_known(const char *rid)
+{
+    gboolean known = FALSE;
+
+    g_mutex_lock(&layers_lock);
+    if (publisher_rids->len == 0)
+        known = !*rid;
+    for (guint i = 0; i < publisher_rids->len; i++)
+        if (!strcmp(g_ptr_array_index(publisher_rids, i), rid))
+            known = TRUE;
+    g_mutex_unlock(&layers_lock);
+    return known;
+}
+
+/* The layer a subscriber gets until it asks: the publisher's best */
+static gchar *default_rid(void)
+{
+    g_mutex_lock(&layers_lock);
+    gchar *rid = g_strdup(publisher_rids->len ? g_ptr_array_index(publisher_rids, 0) : "");
+    g_mutex_unlock(&layers_lock);
+    return rid;
+}
+
+/* RID of a publisher packet, "" without simulcast, NULL if the packet
+ * does not say */
+static gchar *packet_rid(GstBuffer *buf)
+{
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    guint id = g_atomic_int_get(&rid_ext_id);
+    gpointer data;
+    guint size;
+    gchar *rid = NULL;
+
+    if (!id)
+        return g_strdup("");
+    if (gst_rtp_buffer_map(buf, GST_MAP_READ, &rtp)) {
+        if (gst_rtp_buffer_get_extension_onebyte_header(&rtp, id, 0, &data, &size) ||
+            gst_rtp_buffer_get_extension_twobytes_header(&rtp, NULL, id, 0, &data, &size))
+            rid = g_strndup(data, size);
+        gst_rtp_buffer_unmap(&rtp);
+    }
+    return rid;
+}
+
+/* First packet of a publisher SSRC: link it to its layer's tee. Packets
+ * without a RID are dropped until one says which layer this is. */
+static GstPadProbeReturn route_ssrc(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    gchar *rid = packet_rid(GST_PAD_PROBE_INFO_BUFFER(info));
+    if (!rid)
+        return GST_PAD_PROBE_DROP;
+
+    GstElement *tee = layer_tee(rid);
+    GstPad *sinkpad = gst_element_get_static_pad(tee, "sink");
+    GstPad *old = gst_pad_get_peer(sinkpad);
+    if (old) {
+        // An earlier publisher's stream for the same layer
+        gst_pad_unlink(old, sinkpad);
+        gst_object_unref(old);
+    }
+    if (gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK)
+        lwsl_err("[SFU] Failed to link publisher layer \"%s\"\n", rid);
+    else
+        lwsl_user("[SFU] Publisher layer \"%s\" linked\n", rid);
+    gst_object_unref(sinkpad);
+    g_free(rid);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static void on_publisher_ssrc(GstElement *demux, guint ssrc, GstPad *pad, gpointer user_data)
+{
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM | GST_PAD_PROBE_TYPE_BUFFER,
+                      route_ssrc, NULL, NULL);
+}
+
+/* Publisher media arrived: split it by SSRC, one stream per layer */
+static void on_publisher_pad(GstElement *webrtcbin, GstPad *pad, gpointer user_data)
+{
+    struct peer *p = user_data;
+
+    if (GST_PAD_DIRECTION(pad) != GST_PAD_SRC)
+        return;
+
+    GstElement *demux = gst_element_factory_make("rtpssrcdemux", NULL);
+    g_signal_connect(demux, "new-ssrc-pad", G_CALLBACK(on_publisher_ssrc), NULL);
+    gst_bin_add(GST_BIN(pipeline), demux);
+    gst_element_sync_state_with_parent(demux);
+
+    g_mutex_lock(&layers_lock);
+    g_ptr_array_add(p->demuxes, gst_object_ref(demux));
+    g_mutex_unlock(&layers_lock);
+
+    GstPad *sinkpad = gst_element_get_static_pad(demux, "sink");
+    if (gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK)
+        lwsl_err("[SFU] Failed to link publisher stream\n");
+    else
+        lwsl_user("[SFU] Publisher stream linked\n");
+    gst_object_unref(sinkpad);
+}
+
+/* Caps of the publisher's RTP stream; subscribers are offered the same */
+static GstPadProbeReturn on_stream_caps(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+        GstCaps *caps;
+        gst_event_parse_caps(event, &caps);
+
+        g_mutex_lock(&caps_lock);
+        gst_caps_replace(&stream_caps, caps);
+        g_mutex_unlock(&caps_lock);
+
+        g_atomic_int_set(&media_ready, 1);
+        lws_cancel_service(context);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/* Codec preferences for a subscriber transceiver, from the stream caps */
+static GstCaps *subscriber_caps(void)
+{
+    const gchar *media = "video", *encoding = "VP8";
+    gint pt = 96, clock_rate = 90000;
+
+    g_mutex_lock(&caps_lock);
+    if (stream_caps) {
+        const GstStructure *s = gst_caps_get_structure(stream_caps, 0);
+        if (gst_structure_get_string(s, "media"))
+            media = gst_structure_get_string(s, "media");
+        if (gst_structure_get_string(s, "encoding-name"))
+            encoding = gst_structure_get_string(s, "encoding-name");
+        gst_structure_get_int(s, "payload", &pt);
+        gst_structure_get_int(s, "clock-rate", &clock_rate);
+    }
+    GstCaps *caps = gst_caps_new_simple("application/x-rtp",
+                                        "media", G_TYPE_STRING, media,
+                                        "encoding-name", G_TYPE_STRING, encoding,
+                                        "payload", G_TYPE_INT, pt,
+                                        "clock-rate", G_TYPE_INT, clock_rate,
+                                        NULL);
+    g_mutex_unlock(&caps_lock);
+    return caps;
+}
+
+/* Ask the publisher for a keyframe on one layer so a new or switched
+ * subscriber can start decoding */
+static void request_keyframe(GstElement *tee)
+{
+    GstPad *sinkpad = gst_element_get_static_pad(tee, "sink");
+    GstStructure *s = gst_structure_new("GstForceKeyUnit",
+                                        "all-headers", G_TYPE_BOOLEAN, TRUE, NULL);
+    gst_pad_push_event(sinkpad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, s));
+    gst_object_unref(sinkpad);
+}
+
+static GstElement *new_webrtcbin(struct peer *p)
+{
+    GstElement *webrtcbin = gst_element_factory_make("webrtcbin", NULL);
+    g_object_set(webrtcbin, "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_BUNDLE, NULL);
+    g_signal_connect(webrtcbin, "on-ice-candidate",
+                     G_CALLBACK(on_ice_candidate), GINT_TO_POINTER(p->id));
+    g_signal_connect(webrtcbin, "notify::ice-gathering-state",
+                     G_CALLBACK(on_ice_gathering_state), GINT_TO_POINTER(p->id));
+    gst_bin_add(GST_BIN(pipeline), webrtcbin);
+    return webrtcbin;
+}
+
+/* Whether an RTP packet starts a VP8 keyframe (RFC 7741) */
+static gboolean vp8_keyframe_start(GstRTPBuffer *rtp)
+{
+    guint len = gst_rtp_buffer_get_payload_len(rtp);
+    const guint8 *d = gst_rtp_buffer_get_payload(rtp);
+    guint i = 1;
+
+    // S bit set, partition 0
+    if (len < 1 || !(d[0] & 0x10) || (d[0] & 0x0f))
+        return FALSE;
+    if (d[0] & 0x80) {
+        // Extended control bits: skip PictureID, TL0PICIDX and TID/KEYIDX
+        if (len < 2)
+            return FALSE;
+        guint8 x = d[1];
+        i = 2;
+        if (x & 0x80)
+            i += (len > i && (d[i] & 0x80)) ? 2 : 1;
+        if (x & 0x40)
+            i++;
+        if (x & 0x30)
+            i++;
+    }
+    // P bit of the VP8 payload header: 0 for a keyframe
+    return len > i && !(d[i] & 0x01);
+}
+
+/* Forward one subscriber's packets as a single stream: rewrite SSRC,
+ * sequence numbers and timestamps, and after a layer switch start on the
+ * new layer's first keyframe. Only the first caps are passed on, so the
+ * subscriber's webrtcbin never sees a layer's own SSRC. */
+static GstPadProbeReturn forward_rtp(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    struct forward_state *f = user_data;
+
+    if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS &&
+            GST_EVENT_TYPE(event) != GST_EVENT_STREAM_START)
+            return GST_PAD_PROBE_OK;
+        // A new layer's stream-start and caps after a switch
+        if (f->caps_sent)
+            return GST_PAD_PROBE_DROP;
+        if (GST_EVENT_TYPE(event) == GST_EVENT_STREAM_START)
+            return GST_PAD_PROBE_OK;
+
+        GstCaps *caps;
+        gst_event_parse_caps(event, &caps);
+        caps = gst_caps_copy(caps);
+        gst_structure_remove_field(gst_caps_get_structure(caps, 0), "ssrc");
+        GST_PAD_PROBE_INFO_DATA(info) = gst_event_new_caps(caps);
+        gst_event_unref(event);
+        gst_caps_unref(caps);
+        f->caps_sent = TRUE;
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *buf = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    GST_PAD_PROBE_INFO_DATA(info) = buf;
+    if (!gst_rtp_buffer_map(buf, GST_MAP_READWRITE, &rtp))
+        return GST_PAD_PROBE_DROP;
+
+    guint32 ssrc = gst_rtp_buffer_get_ssrc(&rtp);
+    guint16 seq = gst_rtp_buffer_get_seq(&rtp);
+    guint32 ts = gst_rtp_buffer_get_timestamp(&rtp);
+
+    if (!f->started || ssrc != f->in_ssrc) {
+        if (!vp8_keyframe_start(&rtp)) {
+            gst_rtp_buffer_unmap(&rtp);
+            return GST_PAD_PROBE_DROP;
+        }
+        if (!f->started) {
+            f->out_ssrc = ssrc;
+            f->seq_offset = 0;
+            f->ts_offset = 0;
+            f->started = TRUE;
+        } else {
+            f->seq_offset = (guint16)(f->last_seq + 1 - seq);
+            f->ts_offset = f->last_ts + SWITCH_TS_STEP - ts;
+        }
+        f->in_ssrc = ssrc;
+    }
+
+    f->last_seq = seq + f->seq_offset;
+    f->last_ts = ts + f->ts_offset;
+    gst_rtp_buffer_set_ssrc(&rtp, f->out_ssrc);
+    gst_rtp_buffer_set_seq(&rtp, f->last_seq);
+    gst_rtp_buffer_set_timestamp(&rtp, f->last_ts);
+    gst_rtp_buffer_unmap(&rtp);
+    return GST_PAD_PROBE_OK;
+}
+
+/* Link a subscriber's queue to the tee of the layer it wants */
+static void link_layer(struct peer *p)
+{
+    gchar *rid = p->rid && layer_known(p->rid) ? g_strdup(p->rid) : default_rid();
+    GstElement *tee = layer_tee(rid);
+    GstPad *queue_sink = gst_element_get_static_pad(p->queue, "sink");
+
+    if (tee != p->tee) {
+        if (p->tee_pad) {
+            gst_pad_unlink(p->tee_pad, queue_sink);
+            gst_element_release_request_pad(p->tee, p->tee_pad);
+            gst_object_unref(p->tee_pad);
+        }
+        p->tee = tee;
+        p->tee_pad = gst_element_request_pad_simple(tee, "src_%u");
+        if (gst_pad_link(p->tee_pad, queue_sink) != GST_PAD_LINK_OK)
+            lwsl_err("[SFU] Failed to link subscriber %d to layer \"%s\"\n", p->id, rid);
+        else
+            lwsl_user("[SFU] Subscriber %d gets layer \"%s\"\n", p->id, rid);
+        request_keyframe(tee);
+    }
+    gst_object_unref(queue_sink);
+    g_free(rid);
+}
+
+/* Create the subscriber's webrtcbin and attach it to its layer's tee */
+static void attach_subscriber(struct peer *p)
+{
+    GstCaps *caps = subscriber_caps();
+
+    p->webrtc = new_webrtcbin(p);
+    g_signal_connect(p->webrtc, "on-negotiation-needed",
+                     G_CALLBACK(on_negotiation_needed), GINT_TO_POINTER(p->id));
+
+    p->queue = gst_element_factory_make("queue", NULL);
+    g_object_set(p->queue, "leaky", 2 /* downstream */,
+                 "max-size-buffers", 0, "max-size-bytes", 0,
+                 "max-size-time", (guint64)SUBSCRIBER_QUEUE_MS * GST_MSECOND, NULL);
+    gst_bin_add(GST_BIN(pipeline), p->queue);
+
+    // Requesting the sink pad with caps sets the transceiver's codec
+    // preferences, so the Offer does not wait for the first buffer
+    GstPadTemplate *templ =
+        gst_element_class_get_pad_template(GST_ELEMENT_GET_CLASS(p->webrtc), "sink_%u");
+    GstPad *webrtc_sink = gst_element_request_pad(p->webrtc, templ, NULL, caps);
+    GstPad *queue_src = gst_element_get_static_pad(p->queue, "src");
+
+    if (gst_pad_link(queue_src, webrtc_sink) != GST_PAD_LINK_OK)
+        lwsl_err("[SFU] Failed to link subscriber %d\n", p->id);
+    gst_pad_add_probe(queue_src,
+                      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      forward_rtp, &p->fwd, NULL);
+
+    gst_object_unref(webrtc_sink);
+    gst_object_unref(queue_src);
+    gst_caps_unref(caps);
+
+    gst_element_sync_state_with_parent(p->webrtc);
+    gst_element_sync_state_with_parent(p->queue);
+
+    lwsl_user("[SFU] Subscriber %d attached\n", p->id);
+    link_layer(p);
+}
+
+/* select-layer from a subscriber: relink it to that layer's tee */
+static void select_layer(struct peer *p, const char *rid)
+{
+    if (!layer_known(rid)) {
+        lwsl_warn("[SFU] Subscriber %d asked for unknown layer \"%s\"\n", p->id, rid);
+        return;
+    }
+    g_free(p->rid);
+    p->rid = g_strdup(rid);
+    if (p->queue)
+        link_layer(p);
+}
+
+static void free_peer(gpointer data)
+{
+    struct peer *p = data;
+
+    if (p->tee_pad) {
+        gst_element_release_request_pad(p->tee, p->tee_pad);
+        gst_object_unref(p->tee_pad);
+    }
+    if (p->queue) {
+        gst_element_set_state(p->queue, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(pipeline), p->queue);
+    }
+    if (p->webrtc) {
+        g_signal_handlers_disconnect_matched(p->webrtc, G_SIGNAL_MATCH_DATA,
+                                             0, 0, NULL, NULL, GINT_TO_POINTER(p->id));
+        gst_element_set_state(p->webrtc, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(pipeline), p->webrtc);
+    }
+    if (p->demuxes) {
+        g_mutex_lock(&layers_lock);
+        for (guint i = 0; i < p->demuxes->len; i++) {
+            GstElement *demux = g_ptr_array_index(p->demuxes, i);
+            gst_element_set_state(demux, GST_STATE_NULL);
+            gst_bin_remove(GST_BIN(pipeline), demux);
+        }
+        g_mutex_unlock(&layers_lock);
+        g_ptr_array_free(p->demuxes, TRUE);
+    }
+    g_free(p->rid);
+    g_free(p);
+}
+
+static void remove_peer(int id)
+{
+    struct peer *p = g_hash_table_lookup(peers, GINT_TO_POINTER(id));
+    if (!p)
+        return;
+
+    if (p == publisher) {
+        lwsl_user("[SFU] Publisher %d left\n", id);
+        publisher = NULL;
+        g_atomic_int_set(&media_ready, 0);
+    }
+    g_hash_table_remove(peers, GINT_TO_POINTER(id));
+
+    g_mutex_lock(&outbox_lock);
+    g_hash_table_remove(candidate_batches, GINT_TO_POINTER(id));
+    g_mutex_unlock(&outbox_lock);
+}
+
+static void add_subscriber(int id)
+{
+    struct peer *p = g_new0(struct peer, 1);
+    p->id = id;
+    g_hash_table_replace(peers, GINT_TO_POINTER(id), p);
+
+    if (g_atomic_int_get(&media_ready))
+        attach_subscriber(p);
+    else
+        lwsl_user("[SFU] Subscriber %d waiting for publisher media\n", id);
+}
+
+/* Layers announced in the publisher's Offer (a=rid, best first) and the
+ * id of its RID header extension */
+static void parse_layers(const GstSDPMessage *sdp)
+{
+    guint ext_id = 0;
+
+    g_mutex_lock(&layers_lock);
+    g_ptr_array_set_size(publisher_rids, 0);
+    for (guint m = 0; m < gst_sdp_message_medias_len(sdp); m++) {
+        const GstSDPMedia *media = gst_sdp_message_get_media(sdp, m);
+        const gchar *val;
+
+        for (guint i = 0; (val = gst_sdp_media_get_attribute_val_n(media, "rid", i)); i++)
+            if (strstr(val, " send"))
+                g_ptr_array_add(publisher_rids, g_strndup(val, strcspn(val, " ")));
+        for (guint i = 0; (val = gst_sdp_media_get_attribute_val_n(media, "extmap", i)); i++)
+            if (strstr(val, RTP_RID_URI))
+                ext_id = strtoul(val, NULL, 10);
+    }
+    g_atomic_int_set(&rid_ext_id, publisher_rids->len ? ext_id : 0);
+    g_mutex_unlock(&layers_lock);
+}
+
+/* An Offer from a client makes it the publisher */
+static void handle_publisher_offer(int id, const char *offer_text)
+{
+    GstSDPMessage *sdp = NULL;
+
+    if (gst_sdp_message_new_from_text(offer_text, &sdp) != GST_SDP_OK) {
+        lwsl_err("[SFU] Failed to parse Offer from %d\n", id);
+        return;
+    }
+
+    // Whatever this client was before, it is now the (only) publisher
+    remove_peer(id);
+    if (publisher)
+        remove_peer(publisher->id);
+
+    struct peer *p = g_new0(struct peer, 1);
+    p->id = id;
+    p->publisher = TRUE;
+    p->demuxes = g_ptr_array_new_with_free_func(gst_object_unref);
+    p->webrtc = new_webrtcbin(p);
+    g_object_set(p->webrtc, "latency", PUBLISHER_JITTER_MS, NULL);
+    g_signal_connect(p->webrtc, "pad-added", G_CALLBACK(on_publisher_pad), p);
+    gst_element_sync_state_with_parent(p->webrtc);
+    g_hash_table_replace(peers, GINT_TO_POINTER(id), p);
+    publisher = p;
+
+    lwsl_user("[SFU] Client %d is the publisher\n", id);
+
+    // Subscribers on a layer this publisher does not send move to its best
+    parse_layers(sdp);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, peers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct peer *s = value;
+        if (!s->publisher && s->queue)
+            link_layer(s);
+    }
+
+    GstWebRTCSessionDescription *offer =
+        gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_OFFER, sdp);
+    g_signal_emit_by_name(p->webrtc, "set-remote-description", offer, NULL);
+    gst_webrtc_session_description_free(offer);
+
+    GstPromise *promise =
+        gst_promise_new_with_change_func(on_answer_created, sdp_ctx_new(p), sdp_ctx_free);
+    g_signal_emit_by_name(p->webrtc, "create-answer", NULL, promise);
+
+    // We pick the layer per subscriber, so we want all of them
+    g_mutex_lock(&layers_lock);
+    gboolean simulcast = publisher_rids->len > 0;
+    g_mutex_unlock(&layers_lock);
+    if (simulcast)
+        queue_message(g_strdup_printf("to:%d:send-all-layers", id));
+}
+
+static void handle_subscriber_answer(struct peer *p, const char *answer_text)
+{
+    GstSDPMessage *sdp = NULL;
+
+    if (gst_sdp_message_new_from_text(answer_text, &sdp) != GST_SDP_OK) {
+        lwsl_err("[SFU] Failed to parse Answer from %d\n", p->id);
+        return;
+    }
+    GstWebRTCSessionDescription *answer =
+        gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+    g_signal_emit_by_name(p->webrtc, "set-remote-description", answer, NULL);
+    gst_webrtc_session_description_free(answer);
+    lwsl_user("[SFU] Subscriber %d answered\n", p->id);
+}
+
+static void add_remote_candidate(unsigned mline, const char *candidate, void *user)
+{
+    struct peer *p = user;
+    g_signal_emit_by_name(p->webrtc, "add-ice-candidate", mline, candidate);
+}
+
+/* "from:<id>:<msg>" relayed by the signaling server */
+static void handle_client_message(int id, const char *msg)
+{
+    struct peer *p = g_hash_table_lookup(peers, GINT_TO_POINTER(id));
+
+    if (strncmp(msg, "answer:", 7) && strstr(msg, "v=0")) {
+        handle_publisher_offer(id, msg);
+        return;
+    }
+    if (!strncmp(msg, "select-layer:", 13)) {
+        // Simulcast layer for this subscriber only; the publisher keeps
+        // sending every layer
+        if (p && !p->publisher)
+            select_layer(p, msg + 13);
+        else
+            lwsl_user("[SFU] Layer request from %d, not a subscriber, ignoring\n", id);
+        return;
+    }
+    if (!p || !p->webrtc) {
+        lwsl_user("[SFU] Message from %d before it has a peer connection, ignoring\n", id);
+        return;
+    }
+
+    if (!strncmp(msg, "answer:", 7))
+        handle_subscriber_answer(p, msg + 7);
+    else if (!strncmp(msg, "candidates:", 11))
+        candidates_for_each(msg + 11, add_remote_candidate, p);
+    else if (!strncmp(msg, "candidate:", 10))
+        g_signal_emit_by_name(p->webrtc, "add-ice-candidate", 0, msg + 10);
+    else if (!strcmp(msg, "end-of-candidates"))
+        g_signal_emit_by_name(p->webrtc, "add-ice-candidate", 0, "");
+    else
+        lwsl_user("[SFU] Unknown message from %d:\n%s\n", id, msg);
+}
+
+static int websocket_callback(struct lws *wsi, enum lws_callback_reasons reason,
+                              void *user, void *in, size_t len)
+{
+    struct client_session_data *csd = (struct client_session_data *)user;
+
+    switch (reason) {
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+        lwsl_user("[SFU] Connected to signaling server\n");
+        queue_message(g_strdup("register:sfu"));
+        break;
+
+    case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+        // Publisher media is flowing: attach everyone who was waiting
+        if (g_atomic_int_get(&media_ready)) {
+            GHashTableIter iter;
+            gpointer value;
+            g_hash_table_iter_init(&iter, peers);
+            while (g_hash_table_iter_next(&iter, NULL, &value)) {
+                struct peer *p = value;
+                if (!p->publisher && !p->webrtc)
+                    attach_subscriber(p);
+            }
+        }
+
+        // Start a batch window, or send what is already queued
+        g_mutex_lock(&outbox_lock);
+        if (candidates_pending && !batch_scheduled) {
+            batch_scheduled = TRUE;
+            lws_sul_schedule(context, 0, &batch_sul, flush_candidate_batches,
+                             (lws_usec_t)BATCH_WINDOW_MS * LWS_US_PER_MS);
+        }
+        if (!g_queue_is_empty(&outbox))
+            lws_callback_on_writable(client_wsi);
+        g_mutex_unlock(&outbox_lock);
+        break;
+    }
+
+    case LWS_CALLBACK_CLIENT_WRITEABLE: {
+        g_mutex_lock(&outbox_lock);
+        gchar *msg = g_queue_pop_head(&outbox);
+        gboolean more = !g_queue_is_empty(&outbox);
+        g_mutex_unlock(&outbox_lock);
+
+        if (!msg)
+            break;
+
+        size_t msg_len = strlen(msg);
+        unsigned char *buf = malloc(LWS_PRE + msg_len);
+        memcpy(&buf[LWS_PRE], msg, msg_len);
+        if (lws_write(wsi, &buf[LWS_PRE], msg_len, LWS_WRITE_TEXT) < 0)
+            lwsl_err("[SFU] Failed to send message\n");
+        free(buf);
+        g_free(msg);
+
+        if (more)
+            lws_callback_on_writable(wsi);
+        break;
+    }
+
+    case LWS_CALLBACK_CLIENT_RECEIVE: {
+        if (!csd->message)
+            csd->message = g_string_sized_new(4096);
+        if (csd->message->len + len > MAX_MESSAGE_SIZE) {
+            lwsl_err("[SFU] Message too long\n");
+            return -1;
+        }
+        g_string_append_len(csd->message, in, len);
+
+        if (!lws_is_final_fragment(wsi))
+            break;
+
+        char *rest = NULL;
+        if (!strncmp(csd->message->str, "peer-joined:", 12)) {
+            add_subscriber(atoi(csd->message->str + 12));
+        }
+        else if (!strncmp(csd->message->str, "peer-left:", 10)) {
+            lwsl_user("[SFU] Client %s left\n", csd->message->str + 10);
+            remove_peer(atoi(csd->message->str + 10));
+        }
+        else if (!strncmp(csd->message->str, "from:", 5)) {
+            long id = strtol(csd->message->str + 5, &rest, 10);
+            if (rest && *rest == ':')
+                handle_client_message((int)id, rest + 1);
+        }
+        else {
+            lwsl_user("[SFU] Unknown message:\n%s\n", csd->message->str);
+        }
+
+        g_string_truncate(csd->message, 0);
+        break;
+    }
+
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+        lwsl_err("[SFU] Connection error\n");
+        break;
+
+    case LWS_CALLBACK_CLIENT_CLOSED:
+    case LWS_CALLBACK_CLOSED:
+        lwsl_user("[SFU] WebSocket closed\n");
+        if (csd->message) {
+            g_string_free(csd->message, TRUE);
+            csd->message = NULL;
+        }
+        break;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+    lws_set_log_level(LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE, NULL);
+    lwsl_user("[SFU] Starting up\n");
+
+    peers = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_peer);
+    candidate_batches = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                              NULL, candidate_batch_free);
+
+    // Empty pipeline; peer connections are added and removed at runtime
+    pipeline = gst_pipeline_new("sfu");
+    layer_tees = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    publisher_rids = g_ptr_array_new_with_free_func(g_free);
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+
+    static struct lws_protocols protocols[] = {
+        {
+            "signaling-protocol",
+            websocket_callback,
+            sizeof(struct client_session_data),
+            8192
+        },
+        {NULL, NULL, 0, 0}
+    };
+    info.protocols = protocols;
+
+    context = lws_create_context(&info);
+    if (!context) {
+        lwsl_err("[SFU] Failed to create LWS context\n");
+        return 1;
+    }
+
+    struct lws_client_connect_info ccinfo;
+    memset(&ccinfo, 0, sizeof(ccinfo));
+    ccinfo.context = context;
+    ccinfo.address = "localhost";
+    ccinfo.port = 8080;
+    ccinfo.path = "/";
+    ccinfo.protocol = "signaling-protocol";
+
+    client_wsi = lws_client_connect_via_info(&ccinfo);
+    if (!client_wsi) {
+        lwsl_err("[SFU] Failed to connect to server\n");
+        lws_context_destroy(context);
+        return 1;
+    }
+
+    while (1) {
+        lws_service(context, 1000);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    g_hash_table_destroy(peers);
+    gst_object_unref(pipeline);
+    lws_context_destroy(context);
+    return 0;
+}
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <libwebsockets.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include "shm_ring.h"
+
+// Example local consumer: reads the sender's frames from its shared-memory
+// ring in place and computes a trivial statistic per frame. The ring is found
+// through the signaling server (SERVER_SHM:<host_id> <path>) unless a socket
+// path is given with -s.
+#define SIGNALING_PORT 8080
+#define REPORT_INTERVAL_MS 1000
+
+struct per_session_data {
+    char message[4096];
+    size_t len;
+};
+
+static char ring_path[108] = {0};
+static int discovery_failed = 0;
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+// Only SERVER_SHM: matters to us; we are not a WebRTC peer
+static int
+callback_discovery(struct lws *wsi, enum lws_callback_reasons reason,
+                   void *user, void *in, size_t len)
+{
+    struct per_session_data *psd = (struct per_session_data *)user;
+
+    switch (reason) {
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+        lwsl_user("[Consumer] Connected to signaling server, waiting for an endpoint\n");
+        break;
+
+    case LWS_CALLBACK_CLIENT_RECEIVE:
+        if (psd->len + len >= sizeof(psd->message)) {
+            psd->len = 0;   // SDP or similar, nothing for us
+            break;
+        }
+        memcpy(psd->message + psd->len, in, len);
+        psd->len += len;
+        psd->message[psd->len] = '\0';
+
+        if (lws_is_final_fragment(wsi)) {
+            if (!strncmp(psd->message, "SERVER_SHM:", 11)) {
+                char host_id[128], their_host[128], path[sizeof(ring_path)];
+                shm_ring_host_id(host_id, sizeof(host_id));
+
+                if (sscanf(psd->message + 11, "%127s %107s", their_host, path) != 2) {
+                    lwsl_err("[Consumer] Malformed endpoint: %s\n", psd->message + 11);
+                } else if (strcmp(their_host, host_id)) {
+                    lwsl_user("[Consumer] Endpoint is on another host, ignoring\n");
+                } else {
+                    lwsl_user("[Consumer] Using local endpoint %s\n", path);
+                    strcpy(ring_path, path);
+                }
+            }
+            psd->len = 0;
+        }
+        break;
+
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+        lwsl_err("[Consumer] Connection error\n");
+        discovery_failed = 1;
+        break;
+
+    case LWS_CALLBACK_CLIENT_CLOSED:
+        discovery_failed = 1;
+        break;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+// Ask the signaling server where the ring is. Returns 0 once ring_path is set.
+static int discover_endpoint(void)
+{
+    static struct lws_protocols protocols[] = {
+        {
+            "signaling-protocol",
+            callback_discovery,
+            sizeof(struct per_session_data),
+            4096
+        },
+        {NULL, NULL, 0, 0}
+    };
+    struct lws_context_creation_info info;
+    struct lws_client_connect_info ccinfo;
+    struct lws_context *context;
+
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    context = lws_create_context(&info);
+    if (!context) {
+        lwsl_err("[Consumer] Failed to create LWS context\n");
+        return -1;
+    }
+
+    memset(&ccinfo, 0, sizeof(ccinfo));
+    ccinfo.context = context;
+    ccinfo.address = "localhost";
+    ccinfo.port = SIGNALING_PORT;
+    ccinfo.path = "/observer";   // not a media peer, see the signaling server
+    ccinfo.protocol = "signaling-protocol";
+    if (!lws_client_connect_via_info(&ccinfo)) {
+        lwsl_err("[Consumer] Failed to connect\n");
+        lws_context_destroy(context);
+        return -1;
+    }
+
+    while (!ring_path[0] && !discovery_failed && !stop)
+        lws_service(context, 1000);
+
+    lws_context_destroy(context);
+    return ring_path[0] ? 0 : -1;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Mean of the Y plane for raw frames; for VP8, whether it is a keyframe
+// (bit 0 of the frame tag is clear)
+static double analyze(const struct shm_ring *ring, const struct shm_ring_slot *slot)
+{
+    const unsigned char *data = shm_ring_data(slot);
+
+    if (!strcmp(ring->hdr->format, "I420")) {
+        size_t n = (size_t)slot->width * slot->height, sum = 0;
+        if (n == 0 || n > slot->len)
+            return 0;
+        for (size_t i = 0; i < n; i++)
+            sum += data[i];
+        return (double)sum / n;
+    }
+    return slot->len > 0 && !(data[0] & 1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct shm_ring ring;
+    int opt, efd;
+
+    lws_set_log_level(LLL_USER | LLL_ERR | LLL_WARN, NULL);
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's':
+            snprintf(ring_path, sizeof(ring_path), "%s", optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s shm_socket]\n"
+                            "  without -s the endpoint is learned from the signaling server\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if (!ring_path[0] && discover_endpoint() < 0) {
+        fprintf(stderr, "[Consumer] No local endpoint found\n");
+        return 1;
+    }
+
+    if ((efd = shm_ring_attach(&ring, ring_path)) < 0)
+        return 1;
+    printf("[Consumer] Attached: %u slots of %llu bytes, format %s\n",
+           ring.hdr->slot_count, (unsigned long long)ring.hdr->slot_size, ring.hdr->format);
+
+    uint64_t cursor = shm_ring_head(&ring);
+    unsigned long frames = 0, skipped = 0, torn = 0;
+    double value_sum = 0;
+    long long last_report = now_ms();
+
+    while (!stop) {
+        int r = shm_ring_wait(&ring, efd, REPORT_INTERVAL_MS);
+        if (r < 0) {
+            printf("[Consumer] Publisher went away\n");
+            break;
+        }
+
+        // Analytics only wants the newest frame; count the ones we skipped
+        uint64_t head = shm_ring_head(&ring);
+        if (r > 0 && head > cursor) {
+            const struct shm_ring_slot *slot = shm_ring_get(&ring, head);
+            skipped += head - cursor - 1;
+            cursor = head;
+
+            if (slot) {
+                double value = analyze(&ring, slot);
+                if (shm_ring_still_valid(slot, head)) {
+                    frames++;
+                    value_sum += value;
+                } else {
+                    torn++;
+                }
+            } else {
+                torn++;
+            }
+        }
+
+        long long now = now_ms();
+        if (now - last_report >= REPORT_INTERVAL_MS) {
+            printf("[Consumer] fps=%.1f skipped=%lu torn=%lu %s=%.2f\n",
+                   frames * 1000.0 / (now - last_report), skipped, torn,
+                   strcmp(ring.hdr->format, "I420") ? "keyframes" : "mean_luma",
+                   strcmp(ring.hdr->format, "I420") ? value_sum :
+                       (frames ? value_sum / frames : 0));
+            fflush(stdout);
+            frames = skipped = torn = 0;
+            value_sum = 0;
+            last_report = now;
+        }
+    }
+
+    close(efd);
+    shm_ring_destroy(&ring);
+    return 0;
+}
@@ -0,0 +1,388 @@
+// Shared-memory frame ring for consumers on the same host as the sender.
+//
+// The publisher keeps its most recent frames in a memfd: a header followed by
+// fixed-size slots. A reader connects to the publisher's Unix socket and
+// receives a read-only descriptor for the memfd plus its own eventfd through
+// SCM_RIGHTS; the publisher signals every reader's eventfd after each frame.
+// Readers map the ring and use frames in place. A slot can be overwritten
+// while a slow reader is still using it, so readers check the slot's
+// sequence number again afterwards (shm_ring_still_valid).
+//
+// Needs _GNU_SOURCE (memfd_create, file sealing) defined before any include.
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SHM_RING_MAGIC 0x53484d52   // "SHMR"
+#define SHM_RING_MAX_READERS 16
+#define SHM_RING_ALIGN 64
+
+struct shm_ring_header {
+    uint32_t magic;
+    uint32_t slot_count;
+    uint64_t slot_size;         // payload bytes per slot
+    uint64_t slot_stride;       // slot header + payload, cache-line aligned
+    char format[16];            // payload format, e.g. "I420" or "VP8"
+    _Atomic uint64_t head;      // sequence number of the newest frame, 0 = none
+};
+
+struct shm_ring_slot {
+    _Atomic uint64_t seq;       // 0 while being written
+    uint64_t len;
+    uint64_t pts_ns;
+    uint32_t width;
+    uint32_t height;
+    // payload follows
+};
+
+struct shm_ring {
+    struct shm_ring_header *hdr;
+    size_t size;
+    int memfd;
+    int sock_fd;                // publisher: listening socket; reader: connection
+    int readers;
+    int reader_conn[SHM_RING_MAX_READERS];
+    int reader_efd[SHM_RING_MAX_READERS];
+};
+
+#define SHM_RING_ALIGN_UP(n) (((n) + SHM_RING_ALIGN - 1) & ~(size_t)(SHM_RING_ALIGN - 1))
+
+static inline struct shm_ring_slot *shm_ring_slot_at(const struct shm_ring *r, uint64_t seq)
+{
+    return (struct shm_ring_slot *)((char *)r->hdr + SHM_RING_ALIGN_UP(sizeof(*r->hdr)) +
+                                    (seq % r->hdr->slot_count) * r->hdr->slot_stride);
+}
+
+static inline const void *shm_ring_data(const struct shm_ring_slot *slot)
+{
+    return (const char *)slot + SHM_RING_ALIGN_UP(sizeof(*slot));
+}
+
+// An identifier shared by all processes on this host, used to decide whether
+// an advertised ring is reachable
+static inline void shm_ring_host_id(char *buf, size_t len)
+{
+    FILE *f = fopen("/etc/machine-id", "r");
+
+    buf[0] = '\0';
+    if (f) {
+        if (fgets(buf, len, f))
+            buf[strcspn(buf, "\n")] = '\0';
+        fclose(f);
+    }
+    if (!buf[0] && gethostname(buf, len) < 0)
+        snprintf(buf, len, "unknown");
+}
+
+static inline int shm_ring_sockaddr(struct sockaddr_un *addr, const char *path)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Shared-memory socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Publisher: create the ring and listen for readers on `path`.
+// Returns 0 or -1.
+static inline int shm_ring_create(struct shm_ring *r, const char *path, uint32_t slot_count,
+                           size_t slot_size, const char *format)
+{
+    struct sockaddr_un addr;
+    size_t stride = SHM_RING_ALIGN_UP(sizeof(struct shm_ring_slot)) + SHM_RING_ALIGN_UP(slot_size);
+
+    memset(r, 0, sizeof(*r));
+    r->memfd = r->sock_fd = -1;
+    r->size = SHM_RING_ALIGN_UP(sizeof(struct shm_ring_header)) + slot_count * stride;
+
+    if (shm_ring_sockaddr(&addr, path) < 0)
+        return -1;
+
+    // Sealed at its final size, so a reader can never see it shrink under it
+    r->memfd = memfd_create("frame-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (r->memfd < 0 || ftruncate(r->memfd, r->size) < 0 ||
+        fcntl(r->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        perror("Shared-memory ring creation failed");
+        goto fail;
+    }
+
+    r->hdr = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->memfd, 0);
+    if (r->hdr == MAP_FAILED) {
+        perror("Shared-memory ring mmap failed");
+        r->hdr = NULL;
+        goto fail;
+    }
+    r->hdr->magic = SHM_RING_MAGIC;
+    r->hdr->slot_count = slot_count;
+    r->hdr->slot_size = slot_size;
+    r->hdr->slot_stride = stride;
+    snprintf(r->hdr->format, sizeof(r->hdr->format), "%s", format);
+    atomic_store(&r->hdr->head, 0);
+
+    r->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (r->sock_fd < 0 || bind(r->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(r->sock_fd, SHM_RING_MAX_READERS) < 0) {
+        perror("Shared-memory socket bind failed");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (r->hdr)
+        munmap(r->hdr, r->size);
+    if (r->memfd >= 0)
+        close(r->memfd);
+    if (r->sock_fd >= 0)
+        close(r->sock_fd);
+    r->hdr = NULL;
+    return -1;
+}
+
+// Publisher: hand the ring to readers waiting on the socket
+static inline void shm_ring_accept(struct shm_ring *r)
+{
+    int conn;
+
+    while ((conn = accept4(r->sock_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+        char path[64], tag = 'R';
+        struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        int fds[2];
+
+        if (r->readers == SHM_RING_MAX_READERS) {
+            close(conn);
+            continue;
+        }
+
+        // Readers get a read-only descriptor, so they cannot map it writable
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", r->memfd);
+        fds[0] = open(path, O_RDONLY | O_CLOEXEC);
+        fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fds[0] < 0 || fds[1] < 0) {
+            perror("Shared-memory reader setup failed");
+            goto drop;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        if (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0) {
+            perror("Shared-memory sendmsg failed");
+            goto drop;
+        }
+
+        close(fds[0]);
+        r->reader_conn[r->readers] = conn;
+        r->reader_efd[r->readers] = fds[1];
+        r->readers++;
+        continue;
+
+drop:
+        if (fds[0] >= 0)
+            close(fds[0]);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        close(conn);
+    }
+}
+
+// Publisher: forget readers whose connection has gone away. Readers never
+// send anything, so a readable connection means end of file.
+static inline void shm_ring_reap(struct shm_ring *r)
+{
+    for (int i = 0; i < r->readers; ) {
+        struct pollfd pfd = { .fd = r->reader_conn[i], .events = POLLIN };
+        if (poll(&pfd, 1, 0) > 0) {
+            close(r->reader_conn[i]);
+            close(r->reader_efd[i]);
+            r->readers--;
+            r->reader_conn[i] = r->reader_conn[r->readers];
+            r->reader_efd[i] = r->reader_efd[r->readers];
+        } else {
+            i++;
+        }
+    }
+}
+
+// Publisher: copy one frame into the next slot and wake the readers.
+// Frames larger than a slot are dropped; returns 0 or -1.
+static inline int shm_ring_publish(struct shm_ring *r, const void *data, size_t len,
+                            uint64_t pts_ns, uint32_t width, uint32_t height)
+{
+    uint64_t one = 1, seq;
+    struct shm_ring_slot *slot;
+
+    shm_ring_accept(r);
+    shm_ring_reap(r);
+
+    if (len > r->hdr->slot_size)
+        return -1;
+
+    seq = atomic_load_explicit(&r->hdr->head, memory_order_relaxed) + 1;
+    slot = shm_ring_slot_at(r, seq);
+
+    // Readers that see seq 0, or a seq that changed, discard what they read
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy((char *)shm_ring_data(slot), data, len);
+    slot->len = len;
+    slot->pts_ns = pts_ns;
+    slot->width = width;
+    slot->height = height;
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&r->hdr->head, seq, memory_order_release);
+
+    // EAGAIN means the counter is saturated and the reader is due to wake anyway
+    for (int i = 0; i < r->readers; i++)
+        if (write(r->reader_efd[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("Shared-memory reader signal failed");
+    return 0;
+}
+
+// Reader: connect to the publisher at `path` and map its ring.
+// Returns the reader's eventfd, or -1.
+static inline int shm_ring_attach(struct shm_ring *r, const char *path)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+    char tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    int fds[2] = { -1, -1 };
+
+    memset(r, 0, sizeof(*r));
+    r->memfd = -1;
+
+    if (shm_ring_sockaddr(&addr, path) < 0)
+        return -1;
+
+    r->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (r->sock_fd < 0 || connect(r->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Shared-memory connect failed");
+        goto fail;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(r->sock_fd, &msg, MSG_CMSG_CLOEXEC) <= 0 || tag != 'R' ||
+        !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "Shared-memory ring not received\n");
+        goto fail;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    r->memfd = fds[0];
+
+    if (fstat(r->memfd, &st) < 0)
+        goto fail;
+    r->size = st.st_size;
+    r->hdr = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->memfd, 0);
+    if (r->hdr == MAP_FAILED || r->hdr->magic != SHM_RING_MAGIC) {
+        fprintf(stderr, "Shared-memory ring mapping failed\n");
+        if (r->hdr != MAP_FAILED)
+            munmap(r->hdr, r->size);
+        r->hdr = NULL;
+        goto fail;
+    }
+    return fds[1];
+
+fail:
+    if (fds[1] >= 0)
+        close(fds[1]);
+    if (r->memfd >= 0)
+        close(r->memfd);
+    if (r->sock_fd >= 0)
+        close(r->sock_fd);
+    return -1;
+}
+
+// Reader: wait for new frames. Returns 1 when signalled, 0 on timeout and
+// -1 once the publisher has gone away.
+static inline int shm_ring_wait(struct shm_ring *r, int efd, int timeout_ms)
+{
+    struct pollfd pfd[2] = {
+        { .fd = efd, .events = POLLIN },
+        { .fd = r->sock_fd, .events = POLLIN },
+    };
+    uint64_t count;
+
+    if (poll(pfd, 2, timeout_ms) < 0)
+        return -1;
+    if (pfd[1].revents)
+        return -1;
+    if (!(pfd[0].revents & POLLIN))
+        return 0;
+    if (read(efd, &count, sizeof(count)) < 0)
+        return 0;
+    return 1;
+}
+
+// Reader: the slot holding frame `seq`, or NULL if it has been overwritten
+static inline const struct shm_ring_slot *shm_ring_get(const struct shm_ring *r, uint64_t seq)
+{
+    const struct shm_ring_slot *slot = shm_ring_slot_at(r, seq);
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == seq ? slot : NULL;
+}
+
+// Reader: whether a frame used in place was left intact while in use
+static inline int shm_ring_still_valid(const struct shm_ring_slot *slot, uint64_t seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&((struct shm_ring_slot *)slot)->seq, memory_order_relaxed) == seq;
+}
+
+static inline uint64_t shm_ring_head(const struct shm_ring *r)
+{
+    return atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+}
+
+static inline void shm_ring_destroy(struct shm_ring *r)
+{
+    for (int i = 0; i < r->readers; i++) {
+        close(r->reader_conn[i]);
+        close(r->reader_efd[i]);
+    }
+    r->readers = 0;
+    if (r->hdr)
+        munmap(r->hdr, r->size);
+    if (r->memfd >= 0)
+        close(r->memfd);
+    if (r->sock_fd >= 0)
+        close(r->sock_fd);
+    r->hdr = NULL;
+}
+
+#endif
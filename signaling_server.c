@@ -2,26 +2,323 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include "handover.h"
+#include "trace.h"
+#include "candidates.h"
 
-// We'll keep a single Offer + single Answer for simplicity
-static char sdp_offer[4096] = {0};
-static char sdp_answer[4096] = {0};
+#define SIGNALING_PORT 8080
 
-// We'll track versions so we don't keep re-sending the same Offer/Answer
+// Clients that only want SERVER_SHM: (shm_consumer) connect on this path.
+// They take no part in WebRTC: no SDP or candidates, and the SFU is never
+// told about them.
+#define OBSERVER_PATH "/observer"
+
+// Hot restart: a new process started with -t takes over the listening
+// socket through this Unix socket; we then close our clients one by one,
+// spread over the drain window, so they do not all reconnect at once.
+#define DEFAULT_HANDOVER_PATH "/tmp/signaling_server.sock"
+#define DEFAULT_DRAIN_TIMEOUT 30
+#define DRAIN_GRACE_S 2         // for the last close to go out before we exit
+
+// Offers and Answers live in a content-addressed table, keyed by a hash
+// of the frame we send ("SERVER_OFFER:<sdp>" / "SERVER_ANSWER:<sdp>").
+// Each is stored once, already framed with LWS_PRE headroom, so every
+// client (including late joiners) is sent the same buffer. An entry is
+// referenced by current_offer/current_answer and by every session that
+// was last sent it, and freed when the last reference goes.
+#define SDP_TABLE_SIZE 64
+
+// Incoming messages are assembled from their fragments in a buffer laid
+// out like an sdp_entry, with room for the store prefix in front of the
+// message. A new Offer/Answer is framed in place and the receive buffer
+// itself becomes the table entry, so its text is copied only once.
+#define RX_HEADROOM 16                   // >= strlen("SERVER_ANSWER:")
+#define RX_INITIAL_SIZE 4096
+#define MAX_MESSAGE_SIZE (1024 * 1024)
+
+struct sdp_entry {
+    struct sdp_entry *next;     // hash chain
+    uint64_t hash;
+    int refcount;
+    unsigned long version;      // per kind: 1st, 2nd, ... Offer
+    size_t len;                 // frame length, without LWS_PRE
+    unsigned char *frame;       // frame text, with LWS_PRE headroom before it
+    size_t cap;                 // size of buf
+    unsigned char buf[];
+};
+
+static struct sdp_entry *sdp_table[SDP_TABLE_SIZE];
+static struct sdp_entry *current_offer = NULL;
+static struct sdp_entry *current_answer = NULL;
 static unsigned long offer_version = 0;
 static unsigned long answer_version = 0;
-static unsigned long global_version_counter = 1;
+
+// The client that sent the current Offer: the sender, which receives
+// receivers' select-layer: requests
+static struct per_session_data *offer_owner = NULL;
+
+// A frame queued for one client (text starts at data + LWS_PRE)
+struct queued_msg {
+    struct queued_msg *next;
+    size_t len;
+    int64_t queued_us;
+    unsigned char data[];
+};
 
 // Per-connection data
 struct per_session_data {
-    char message[4096];
+    struct sdp_entry *rx;       // receive buffer, see RX_HEADROOM
+    char *message;              // the message being assembled, in rx
     size_t len;
 
-    unsigned long seen_offer_version;
-    unsigned long seen_answer_version;
+    // The descriptions last sent to this client; a different current
+    // entry means it has not seen the latest one yet
+    struct sdp_entry *sent_offer;
+    struct sdp_entry *sent_answer;
+
+    // ICE candidate lines ("<mlineindex> <candidate>\n") from other clients,
+    // coalesced until this connection is writeable and sent as one frame
+    char *pending_candidates;
+    size_t pending_len;
+    size_t pending_cap;
+    int pending_end_of_candidates;
+    int64_t pending_since_us;
+
+    // Addressed messages (SFU routing), sent one per writeable callback
+    int id;
+    int is_sfu;
+    struct queued_msg *outq_head;
+    struct queued_msg *outq_tail;
+    int shm_pending;            // SERVER_SHM: to send, ahead of any Offer
+    int observer;               // connected on OBSERVER_PATH, not a media peer
+
+    // List of connected clients, used to drain them on handover
+    struct lws *wsi;
+    struct per_session_data *next;
+    int closing;
 };
 
-static void maybe_send_offer_and_answer(struct lws *wsi);
+static struct lws_context *context;
+static struct lws_vhost *vhost;
+
+// We own the listening socket (instead of letting lws create it) so that it
+// can be handed over; lws polls it as a raw file and we adopt accepted fds
+static int listen_fd = -1;
+static int handover_fd = -1;
+static struct lws *listener_wsi;
+static const char *handover_path = DEFAULT_HANDOVER_PATH;
+static int drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+
+static struct per_session_data *sessions;
+static int session_count = 0;
+static int handed_over = 0;
+static lws_usec_t drain_interval;
+static lws_usec_t drain_deadline;   // clients still connected then are dropped
+static lws_sorted_usec_list_t drain_sul;
+
+// When an SFU has registered, every other client talks only to it: their
+// messages reach the SFU as "from:<id>:<msg>", and the SFU answers with
+// "to:<id>:<msg>". It is told about clients with peer-joined/peer-left.
+static struct per_session_data *sfu_session = NULL;
+static int next_session_id = 1;
+
+// Shared-memory endpoint published by a sender ("<host_id> <socket path>"),
+// handed to every client as SERVER_SHM:. Only clients on the same host use it.
+static char shm_endpoint[256] = {0};
+static struct per_session_data *shm_owner = NULL;
+
+static int maybe_send_offer_and_answer(struct lws *wsi);
+static int send_shm_endpoint(struct lws *wsi);
+static int send_pending_candidates(struct lws *wsi);
+
+// Queue candidate lines (and/or end-of-candidates) for every other client
+// and wake only those connections
+static void forward_candidates(struct per_session_data *from,
+                               const char *lines, size_t len, int end)
+{
+    struct per_session_data *p;
+
+    for (p = sessions; p; p = p->next) {
+        if (p == from || p->closing || p->observer)
+            continue;
+
+        if (len > 0) {
+            if (p->pending_len + len > p->pending_cap) {
+                size_t cap = p->pending_cap ? p->pending_cap : 1024;
+                while (cap < p->pending_len + len)
+                    cap *= 2;
+                char *buf = realloc(p->pending_candidates, cap);
+                if (!buf) {
+                    lwsl_err("[Signaling] Out of memory queueing candidates\n");
+                    continue;
+                }
+                p->pending_candidates = buf;
+                p->pending_cap = cap;
+            }
+            memcpy(p->pending_candidates + p->pending_len, lines, len);
+            p->pending_len += len;
+        }
+        if (end)
+            p->pending_end_of_candidates = 1;
+        if (!p->pending_since_us)
+            p->pending_since_us = trace_now_us();
+
+        lws_callback_on_writable(p->wsi);
+    }
+}
+
+// Queue prefix + msg as one frame for a single client
+static void queue_to(struct per_session_data *p, const char *prefix,
+                     const char *msg, size_t len)
+{
+    size_t prefix_len = strlen(prefix);
+    struct queued_msg *m = malloc(sizeof(*m) + LWS_PRE + prefix_len + len);
+
+    if (!m) {
+        lwsl_err("[Signaling] Out of memory queueing message\n");
+        return;
+    }
+    m->next = NULL;
+    m->len = prefix_len + len;
+    m->queued_us = trace_now_us();
+    memcpy(m->data + LWS_PRE, prefix, prefix_len);
+    memcpy(m->data + LWS_PRE + prefix_len, msg, len);
+
+    if (p->outq_tail)
+        p->outq_tail->next = m;
+    else
+        p->outq_head = m;
+    p->outq_tail = m;
+
+    lws_callback_on_writable(p->wsi);
+}
+
+// FNV-1a over the prefix and the SDP, as they will be framed
+static uint64_t sdp_hash(const char *prefix, const char *sdp, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *prefix; prefix++)
+        h = (h ^ (unsigned char)*prefix) * 0x100000001b3ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)sdp[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static struct sdp_entry *sdp_ref(struct sdp_entry *e)
+{
+    if (e)
+        e->refcount++;
+    return e;
+}
+
+static void sdp_unref(struct sdp_entry *e)
+{
+    struct sdp_entry **pp;
+
+    if (!e || --e->refcount > 0)
+        return;
+    for (pp = &sdp_table[e->hash % SDP_TABLE_SIZE]; *pp; pp = &(*pp)->next) {
+        if (*pp == e) {
+            *pp = e->next;
+            break;
+        }
+    }
+    free(e);
+}
+
+// Append a fragment to the message being received. Returns -1 if the
+// message grows too large.
+static int rx_append(struct per_session_data *psd, const void *in, size_t len)
+{
+    size_t need = LWS_PRE + RX_HEADROOM + psd->len + len + 1;
+
+    if (psd->len + len > MAX_MESSAGE_SIZE)
+        return -1;
+    if (!psd->rx || psd->rx->cap < need) {
+        size_t cap = psd->rx ? psd->rx->cap : RX_INITIAL_SIZE;
+        struct sdp_entry *rx;
+
+        while (cap < need)
+            cap *= 2;
+        if (!(rx = realloc(psd->rx, sizeof(*rx) + cap)))
+            return -1;
+        rx->cap = cap;
+        psd->rx = rx;
+        psd->message = (char *)rx->buf + LWS_PRE + RX_HEADROOM;
+    }
+    memcpy(psd->message + psd->len, in, len);
+    psd->len += len;
+    psd->message[psd->len] = '\0';
+    return 0;
+}
+
+// Make prefix + sdp the current description held in *current, where sdp
+// is the tail of the message psd has just received. Returns 0 if it
+// already was, 1 if it changed (the new entry may be an older one that is
+// still referenced, e.g. a sender going back to a previous Offer). A new
+// description takes over psd's receive buffer.
+static int sdp_store(struct sdp_entry **current, unsigned long *version, const char *prefix,
+                     struct per_session_data *psd, const char *sdp, size_t len)
+{
+    size_t prefix_len = strlen(prefix);
+    uint64_t h = sdp_hash(prefix, sdp, len);
+    struct sdp_entry *e;
+
+    for (e = sdp_table[h % SDP_TABLE_SIZE]; e; e = e->next)
+        if (e->hash == h && e->len == prefix_len + len &&
+            !memcmp(e->frame + prefix_len, sdp, len))
+            break;
+
+    if (e && e == *current)
+        return 0;
+
+    if (!e) {
+        // Frame it in place: the prefix overwrites the headroom and
+        // whatever preceded the SDP in the message ("answer:")
+        e = psd->rx;
+        psd->rx = NULL;
+        psd->message = NULL;
+        e->frame = (unsigned char *)sdp - prefix_len;
+        memcpy(e->frame, prefix, prefix_len);
+        e->hash = h;
+        e->refcount = 0;
+        e->version = ++*version;
+        e->len = prefix_len + len;
+        e->next = sdp_table[h % SDP_TABLE_SIZE];
+        sdp_table[h % SDP_TABLE_SIZE] = e;
+    }
+
+    sdp_ref(e);
+    sdp_unref(*current);
+    *current = e;
+    return 1;
+}
+
+static void notify_sfu(const char *event, int id)
+{
+    char msg[64];
+    int n = snprintf(msg, sizeof(msg), "%s:%d", event, id);
+    queue_to(sfu_session, "", msg, n);
+}
+
+static int is_observer(struct lws *wsi)
+{
+    char uri[32];
+    return lws_hdr_copy(wsi, uri, sizeof(uri), WSI_TOKEN_GET_URI) > 0 &&
+           !strcmp(uri, OBSERVER_PATH);
+}
+
+static struct per_session_data *find_session(int id)
+{
+    struct per_session_data *p;
+    for (p = sessions; p; p = p->next)
+        if (p->id == id)
+            return p;
+    return NULL;
+}
 
 // The server callback
 static int
@@ -34,58 +331,152 @@ callback_signaling(struct lws *wsi, enum lws_callback_reasons reason,
 
     case LWS_CALLBACK_ESTABLISHED:
         lwsl_user("[Signaling] New client connected\n");
-        // Mark that this connection hasn't seen any versions yet
-        psd->seen_offer_version = 0;
-        psd->seen_answer_version = 0;
+        // Nothing sent to this connection yet
+        psd->sent_offer = NULL;
+        psd->sent_answer = NULL;
 
-        // If we already have an Offer/Answer, schedule a write
-        if (strlen(sdp_offer) > 0 || strlen(sdp_answer) > 0) {
+        psd->wsi = wsi;
+        psd->closing = 0;
+        psd->next = sessions;
+        sessions = psd;
+        session_count++;
+
+        psd->id = next_session_id++;
+        psd->observer = is_observer(wsi);
+        if (psd->observer)
+            lwsl_user("[Signaling] Client %d is an observer\n", psd->id);
+        else if (sfu_session)
+            notify_sfu("peer-joined", psd->id);
+        psd->shm_pending = shm_endpoint[0] != 0;
+
+        // If we already have an endpoint or an Offer/Answer, schedule a write
+        if (psd->shm_pending || (!psd->observer && (current_offer || current_answer))) {
             lws_callback_on_writable(wsi);
         }
         break;
 
     case LWS_CALLBACK_RECEIVE: {
-        if (len >= sizeof(psd->message)) {
+        int64_t received_us = trace_now_us();
+
+        if (rx_append(psd, in, len) < 0) {
             lwsl_err("[Signaling] Message too long\n");
             return -1;
         }
-        memcpy(psd->message, in, len);
-        psd->message[len] = '\0';
-        psd->len = len;
+        if (!lws_is_final_fragment(wsi))
+            break;
+        len = psd->len;
+        psd->len = 0;   // the next fragment starts a new message
+
+        // Local endpoints are for the server itself, whoever is routing media
+        if (!strncmp(psd->message, "shm-endpoint:", 13)) {
+            struct per_session_data *p;
+            lwsl_user("[Signaling] Client %d offers shared memory: %s\n",
+                      psd->id, psd->message + 13);
+            snprintf(shm_endpoint, sizeof(shm_endpoint), "%s", psd->message + 13);
+            shm_owner = psd;
+            for (p = sessions; p; p = p->next)
+                if (p != psd && !p->is_sfu) {
+                    p->shm_pending = 1;
+                    lws_callback_on_writable(p->wsi);
+                }
+        }
+        else if (psd->observer) {
+            lwsl_user("[Signaling] Ignoring message from observer %d\n", psd->id);
+        }
+        // SFU routing comes next: once an SFU is registered, clients
+        // only talk to it
+        else if (!strcmp(psd->message, "register:sfu")) {
+            struct per_session_data *p;
+            lwsl_user("[Signaling] Client %d registered as SFU\n", psd->id);
+            psd->is_sfu = 1;
+            sfu_session = psd;
+            for (p = sessions; p; p = p->next)
+                if (p != psd && !p->observer)
+                    notify_sfu("peer-joined", p->id);
+        }
+        else if (psd->is_sfu) {
+            char *rest = NULL;
+            long id = !strncmp(psd->message, "to:", 3) ?
+                strtol(psd->message + 3, &rest, 10) : 0;
+            struct per_session_data *target = id > 0 ? find_session(id) : NULL;
 
-        // Distinguish "candidate:", "answer:", or an SDP Offer
-        if (!strncmp(psd->message, "candidate:", 10)) {
-            // ICE candidate from sender or receiver
+            if (target && rest && *rest == ':')
+                queue_to(target, "", rest + 1, len - (rest + 1 - psd->message));
+            else
+                lwsl_user("[Signaling] SFU message for unknown client:\n%s\n", psd->message);
+        }
+        else if (sfu_session) {
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "from:%d:", psd->id);
+            queue_to(sfu_session, prefix, psd->message, len);
+        }
+        // Distinguish candidates, "answer:", or an SDP Offer
+        else if (!strncmp(psd->message, "candidates:", 11)) {
+            // Batch of ICE candidates from sender or receiver
+            const char *lines = psd->message + 11;
+            size_t lines_len = len - 11;
+            if (lines_len > 0 && lines[lines_len - 1] == '\n') {
+                lwsl_user("[Signaling] Received ICE candidates:\n%s", lines);
+                forward_candidates(psd, lines, lines_len, 0);
+            } else {
+                lwsl_err("[Signaling] Malformed candidates message\n");
+            }
+        }
+        else if (!strncmp(psd->message, "candidate:", 10)) {
+            // Single ICE candidate (older clients), forwarded as a batch line
+            size_t n = len - 10 + 3;
+            char *line = malloc(n + 1);
             lwsl_user("[Signaling] Received ICE candidate:\n%s\n", psd->message);
-            //  re-broadcast to all
-            lws_callback_on_writable_all_protocol(lws_get_context(wsi),
-                                                  lws_get_protocol(wsi));
+            if (line) {
+                snprintf(line, n + 1, "0 %s\n", psd->message + 10);
+                forward_candidates(psd, line, n, 0);
+                free(line);
+            }
+        }
+        else if (!strcmp(psd->message, "end-of-candidates")) {
+            lwsl_user("[Signaling] Received end-of-candidates\n");
+            forward_candidates(psd, NULL, 0, 1);
+        }
+        else if (!strncmp(psd->message, "select-layer:", 13)) {
+            // Simulcast layer request from a receiver, for the sender only
+            if (offer_owner && offer_owner != psd && !offer_owner->closing) {
+                lwsl_user("[Signaling] Client %d selects layer %s\n", psd->id, psd->message + 13);
+                queue_to(offer_owner, "", psd->message, len);
+            } else {
+                lwsl_user("[Signaling] Layer request from %d but no sender, ignoring\n", psd->id);
+            }
+        }
+        else if (!strcmp(psd->message, "fetch-sdp")) {
+            // Resend the current Offer/Answer, e.g. after a client restarts
+            // its peer connection without reconnecting
+            sdp_unref(psd->sent_offer);
+            sdp_unref(psd->sent_answer);
+            psd->sent_offer = psd->sent_answer = NULL;
+            lws_callback_on_writable(wsi);
         }
         else if (!strncmp(psd->message, "answer:", 7)) {
             // It's an Answer
             const char *answer_text = psd->message + 7;
-            if (strcmp(sdp_answer, answer_text) == 0) {
+            if (!sdp_store(&current_answer, &answer_version, "SERVER_ANSWER:",
+                           psd, answer_text, len - 7)) {
                 lwsl_user("[Signaling] Same Answer as before, ignoring\n");
             } else {
-                lwsl_user("[Signaling] Storing NEW SDP Answer:\n%s\n", answer_text);
-                strncpy(sdp_answer, answer_text, sizeof(sdp_answer) - 1);
-                sdp_answer[sizeof(sdp_answer) - 1] = '\0';
-
-                answer_version = ++global_version_counter;
+                lwsl_user("[Signaling] Storing SDP Answer #%lu:\n%s\n",
+                          current_answer->version, answer_text);
                 lws_callback_on_writable_all_protocol(lws_get_context(wsi),
                                                       lws_get_protocol(wsi));
             }
         }
         else if (strstr(psd->message, "v=0")) {
             //  treat anything containing "v=0" as an SDP Offer
-            if (strcmp(sdp_offer, psd->message) == 0) {
+            const char *offer_text = psd->message;
+            offer_owner = psd;
+            if (!sdp_store(&current_offer, &offer_version, "SERVER_OFFER:",
+                           psd, offer_text, len)) {
                 lwsl_user("[Signaling] Same Offer as before, ignoring\n");
             } else {
-                lwsl_user("[Signaling] Storing NEW SDP Offer:\n%s\n", psd->message);
-                strncpy(sdp_offer, psd->message, sizeof(sdp_offer) - 1);
-                sdp_offer[sizeof(sdp_offer) - 1] = '\0';
-
-                offer_version = ++global_version_counter;
+                lwsl_user("[Signaling] Storing SDP Offer #%lu:\n%s\n",
+                          current_offer->version, offer_text);
                 lws_callback_on_writable_all_protocol(lws_get_context(wsi),
                                                       lws_get_protocol(wsi));
             }
@@ -93,26 +484,90 @@ callback_signaling(struct lws *wsi, enum lws_callback_reasons reason,
         else {
             lwsl_user("[Signaling] Unknown message:\n%s\n", psd->message);
         }
+        TRACE_SPAN(signaling_receive_to_forward, "signaling", received_us);
+        break;
+    }
+
+    case LWS_CALLBACK_CLOSED: {
+        struct per_session_data **pp;
+        for (pp = &sessions; *pp; pp = &(*pp)->next) {
+            if (*pp == psd) {
+                *pp = psd->next;
+                session_count--;
+                break;
+            }
+        }
+        free(psd->pending_candidates);
+        psd->pending_candidates = NULL;
+        free(psd->rx);
+        psd->rx = NULL;
+        sdp_unref(psd->sent_offer);
+        sdp_unref(psd->sent_answer);
+        psd->sent_offer = psd->sent_answer = NULL;
+        while (psd->outq_head) {
+            struct queued_msg *m = psd->outq_head;
+            psd->outq_head = m->next;
+            free(m);
+        }
+
+        if (psd == offer_owner)
+            offer_owner = NULL;
+        if (psd == shm_owner) {
+            shm_owner = NULL;
+            shm_endpoint[0] = '\0';
+        }
+
+        if (psd == sfu_session) {
+            lwsl_user("[Signaling] SFU disconnected, back to peer-to-peer\n");
+            sfu_session = NULL;
+        } else if (sfu_session && !psd->observer) {
+            notify_sfu("peer-left", psd->id);
+        }
+        lwsl_user("[Signaling] Client disconnected (%d remaining)\n", session_count);
         break;
     }
 
-    case LWS_CALLBACK_SERVER_WRITEABLE:
-        // Possibly send new Offer/Answer to this connection
-        maybe_send_offer_and_answer(wsi);
+    case LWS_CALLBACK_SERVER_WRITEABLE: {
+        if (psd->closing) {
+            // Draining after a handover: ask the client to reconnect
+            lws_close_reason(wsi, LWS_CLOSE_STATUS_GOINGAWAY,
+                             (unsigned char *)"restart", 7);
+            return -1;
+        }
+
+        // One frame per writeable callback: the local endpoint first, so a
+        // receiver on this host can skip WebRTC before it answers, then a new
+        // Offer/Answer, ICE candidates and the next addressed message
+        int wrote = psd->shm_pending ? send_shm_endpoint(wsi) : 0;
+
+        if (!wrote && !psd->is_sfu && !psd->observer)
+            wrote = maybe_send_offer_and_answer(wsi);
 
-        // If the last message was an ICE candidate, forward it
-        if (!strncmp(psd->message, "candidate:", 10)) {
-            unsigned char buf[LWS_PRE + 4096];
-            memset(buf, 0, sizeof(buf));
-            snprintf((char*)&buf[LWS_PRE], sizeof(buf) - LWS_PRE,
-                     "%s", psd->message);
+        if (!wrote)
+            wrote = send_pending_candidates(wsi);
 
-            lwsl_user("[Signaling] Forwarding ICE candidate to this client\n");
-            lws_write(wsi, &buf[LWS_PRE],
-                      strlen((char*)&buf[LWS_PRE]),
-                      LWS_WRITE_TEXT);
+        if (!wrote && psd->outq_head) {
+            struct queued_msg *m = psd->outq_head;
+            psd->outq_head = m->next;
+            if (!psd->outq_head)
+                psd->outq_tail = NULL;
+
+            wrote = lws_write(wsi, m->data + LWS_PRE, m->len, LWS_WRITE_TEXT) < 0 ? -1 : 1;
+            TRACE_SPAN(signaling_queued_to_write, "signaling", m->queued_us);
+            free(m);
+        }
+
+        if (wrote < 0) {
+            lwsl_err("[Signaling] Failed to send to client %d\n", psd->id);
+            return -1;
         }
+        if ((!psd->is_sfu && !psd->observer && ((current_offer && psd->sent_offer != current_offer) ||
+                              (current_answer && psd->sent_answer != current_answer))) ||
+            psd->pending_len > 0 || psd->pending_end_of_candidates || psd->outq_head ||
+            psd->shm_pending)
+            lws_callback_on_writable(wsi);
         break;
+    }
 
     default:
         break;
@@ -120,51 +575,235 @@ callback_signaling(struct lws *wsi, enum lws_callback_reasons reason,
     return 0;
 }
 
-// Helper: send Offer/Answer only if there's a new version
-static void maybe_send_offer_and_answer(struct lws *wsi)
+// Helper: send the current description from the store if this client was
+// last sent a different one. The stored frame is written as is.
+// Returns 1 if a frame was written, 0 if none was due, -1 on error.
+static int maybe_send_sdp(struct lws *wsi, struct sdp_entry *current,
+                          struct sdp_entry **sent, const char *what)
+{
+    if (!current || *sent == current)
+        return 0;
+
+    lwsl_user("[Signaling] Sending SDP %s #%lu to this client\n", what, current->version);
+    if (lws_write(wsi, current->frame, current->len, LWS_WRITE_TEXT) < 0)
+        return -1;
+    sdp_unref(*sent);
+    *sent = sdp_ref(current);
+    return 1;
+}
+
+static int maybe_send_offer_and_answer(struct lws *wsi)
 {
     struct per_session_data *psd =
         (struct per_session_data *)lws_wsi_user(wsi);
+    int r = maybe_send_sdp(wsi, current_offer, &psd->sent_offer, "Offer");
+
+    return r ? r : maybe_send_sdp(wsi, current_answer, &psd->sent_answer, "Answer");
+}
 
-    // If there's a new Offer that this client hasn't seen
-    if (strlen(sdp_offer) > 0 && psd->seen_offer_version < offer_version) {
-        unsigned char buffer[LWS_PRE + 4096];
-        memset(buffer, 0, sizeof(buffer));
-        snprintf((char*)&buffer[LWS_PRE], sizeof(buffer) - LWS_PRE,
-                 "SERVER_OFFER:%s", sdp_offer);
+// The sender's shared-memory ring, unless it has gone away meanwhile
+static int send_shm_endpoint(struct lws *wsi)
+{
+    struct per_session_data *psd =
+        (struct per_session_data *)lws_wsi_user(wsi);
+    unsigned char buf[LWS_PRE + 11 + sizeof(shm_endpoint)];
+    size_t len = strlen(shm_endpoint);
+
+    psd->shm_pending = 0;
+    if (!len)
+        return 0;
+    memcpy(buf + LWS_PRE, "SERVER_SHM:", 11);
+    memcpy(buf + LWS_PRE + 11, shm_endpoint, len);
+    return lws_write(wsi, buf + LWS_PRE, 11 + len, LWS_WRITE_TEXT) < 0 ? -1 : 1;
+}
+
+// Close one client per tick so the reconnects are spread over the drain window
+static void drain_tick(lws_sorted_usec_list_t *sul)
+{
+    struct per_session_data *p;
+
+    for (p = sessions; p; p = p->next) {
+        if (!p->closing) {
+            p->closing = 1;
+            lws_callback_on_writable(p->wsi);
+            break;
+        }
+    }
+    if (p)
+        lws_sul_schedule(context, 0, &drain_sul, drain_tick, drain_interval);
+}
+
+static void start_drain(void)
+{
+    handed_over = 1;
+    drain_deadline = lws_now_usecs() + (lws_usec_t)(drain_timeout + DRAIN_GRACE_S) * LWS_US_PER_SEC;
+    lwsl_user("[Signaling] Listening socket handed over, draining %d clients\n",
+              session_count);
+
+    // Stop accepting; the new process holds its own reference to the socket
+    if (listener_wsi)
+        lws_set_timeout(listener_wsi, PENDING_TIMEOUT_CLOSE_SEND, LWS_TO_KILL_ASYNC);
+
+    if (session_count > 0) {
+        drain_interval = (lws_usec_t)drain_timeout * LWS_US_PER_SEC / session_count;
+        lws_sul_schedule(context, 0, &drain_sul, drain_tick, drain_interval);
+    }
+}
+
+// Accept pending connections and hand them to lws as WebSocket clients
+static void accept_clients(void)
+{
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (!lws_adopt_socket_vhost(vhost, fd)) {
+            lwsl_err("[Signaling] Failed to adopt client socket\n");
+            close(fd);
+        }
+    }
+}
 
-        lwsl_user("[Signaling] Sending NEW SDP Offer to this client\n");
-        if (lws_write(wsi, &buffer[LWS_PRE],
-                      strlen((char*)&buffer[LWS_PRE]),
-                      LWS_WRITE_TEXT) >= 0) {
-            psd->seen_offer_version = offer_version;
+// Callback for the raw listening sockets (TCP listener and handover socket)
+static int
+callback_listener(struct lws *wsi, enum lws_callback_reasons reason,
+                  void *user, void *in, size_t len)
+{
+    switch (reason) {
+    case LWS_CALLBACK_RAW_RX_FILE:
+        if (lws_get_socket_fd(wsi) == listen_fd) {
+            accept_clients();
+        } else if (handover_send(handover_fd, &listen_fd, 1) == 0) {
+            start_drain();
+            return -1; // closes the handover socket
         }
+        break;
+
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
+        if (wsi == listener_wsi)
+            listener_wsi = NULL;
+        break;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+static struct lws *adopt_listener(int fd)
+{
+    lws_sock_file_fd_type u;
+    u.filefd = (lws_filefd_type)(intptr_t)fd;
+    return lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, u,
+                                      "signaling-listener", NULL);
+}
+
+static int create_listen_socket(void)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        lwsl_err("[Signaling] Socket creation failed\n");
+        return -1;
     }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
-    // If there's a new Answer
-    if (strlen(sdp_answer) > 0 && psd->seen_answer_version < answer_version) {
-        unsigned char buffer[LWS_PRE + 4096];
-        memset(buffer, 0, sizeof(buffer));
-        snprintf((char*)&buffer[LWS_PRE], sizeof(buffer) - LWS_PRE,
-                 "SERVER_ANSWER:%s", sdp_answer);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(SIGNALING_PORT);
 
-        lwsl_user("[Signaling] Sending NEW SDP Answer to this client\n");
-        if (lws_write(wsi, &buffer[LWS_PRE],
-                      strlen((char*)&buffer[LWS_PRE]),
-                      LWS_WRITE_TEXT) >= 0) {
-            psd->seen_answer_version = answer_version;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        lwsl_err("[Signaling] Bind/listen on port %d failed\n", SIGNALING_PORT);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Helper: send the candidates queued for this connection, as many whole
+// lines as fit into one frame, or else a pending end-of-candidates.
+// Returns 1 if a frame was written, 0 if nothing was queued, -1 on error.
+static int send_pending_candidates(struct lws *wsi)
+{
+    struct per_session_data *psd =
+        (struct per_session_data *)lws_wsi_user(wsi);
+    int r = 0;
+
+    if (psd->pending_len > 0) {
+        size_t n = candidates_frame_len(psd->pending_candidates, psd->pending_len);
+        unsigned char *buf = malloc(LWS_PRE + CANDIDATES_PREFIX_LEN + n);
+
+        if (!buf) {
+            lwsl_err("[Signaling] Out of memory sending candidates\n");
+            return -1;
         }
+        memcpy(&buf[LWS_PRE], CANDIDATES_PREFIX, CANDIDATES_PREFIX_LEN);
+        memcpy(&buf[LWS_PRE + CANDIDATES_PREFIX_LEN], psd->pending_candidates, n);
+
+        lwsl_user("[Signaling] Forwarding ICE candidates to this client\n");
+        r = lws_write(wsi, &buf[LWS_PRE], CANDIDATES_PREFIX_LEN + n, LWS_WRITE_TEXT) < 0 ? -1 : 1;
+        free(buf);
+        if (r < 0)
+            return r;
+
+        psd->pending_len -= n;
+        memmove(psd->pending_candidates, psd->pending_candidates + n, psd->pending_len);
+    } else if (psd->pending_end_of_candidates) {
+        unsigned char buf[LWS_PRE + 17];
+        memcpy(&buf[LWS_PRE], "end-of-candidates", 17);
+        if (lws_write(wsi, &buf[LWS_PRE], 17, LWS_WRITE_TEXT) < 0)
+            return -1;
+        psd->pending_end_of_candidates = 0;
+        r = 1;
     }
+
+    // Time from the first coalesced candidate to the last frame going out
+    if (r && psd->pending_since_us && !psd->pending_len && !psd->pending_end_of_candidates) {
+        TRACE_SPAN(signaling_candidates_coalesced, "signaling", psd->pending_since_us);
+        psd->pending_since_us = 0;
+    }
+    return r;
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    int takeover = 0, handover_conn = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:td:h")) != -1) {
+        switch (opt) {
+        case 's': handover_path = optarg; break;
+        case 't': takeover = 1; break;
+        case 'd': drain_timeout = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-s handover_socket] [-t] [-d drain_seconds]\n"
+                            "  -t takes over the listening socket from the running server at -s.\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
     lws_set_log_level(LLL_USER | LLL_ERR | LLL_WARN | LLL_NOTICE, NULL);
     lwsl_user("[Signaling] Starting signaling server...\n");
+    trace_init("signaling_server");
+
+    if (takeover) {
+        if (handover_receive(handover_path, &listen_fd, 1, &handover_conn) != 1) {
+            lwsl_err("[Signaling] Takeover from %s failed\n", handover_path);
+            return 1;
+        }
+        lwsl_user("[Signaling] Took over listening socket from previous server\n");
+    } else if ((listen_fd = create_listen_socket()) < 0) {
+        return 1;
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
 
     struct lws_context_creation_info info;
     memset(&info, 0, sizeof(info));
-    info.port = 8080;
+    info.port = CONTEXT_PORT_NO_LISTEN; // we adopt connections from listen_fd
 
     static struct lws_protocols protocols[] = {
         {
@@ -173,23 +812,48 @@ int main(void)
             sizeof(struct per_session_data),
             4096
         },
+        {
+            "signaling-listener",
+            callback_listener,
+            0,
+            0
+        },
         {NULL, NULL, 0, 0}
     };
     info.protocols = protocols;
 
-    struct lws_context *context = lws_create_context(&info);
+    context = lws_create_context(&info);
     if (!context) {
         lwsl_err("[Signaling] Failed to create WebSocket context\n");
         return 1;
     }
 
-    lwsl_user("[Signaling] Server running on ws://localhost:8080\n");
+    vhost = lws_get_vhost_by_name(context, "default");
+    listener_wsi = adopt_listener(listen_fd);
+    if (!vhost || !listener_wsi) {
+        lwsl_err("[Signaling] Failed to watch listening socket\n");
+        lws_context_destroy(context);
+        return 1;
+    }
+
+    if (handover_conn >= 0)
+        handover_ack(handover_conn);
+
+    // Accept future takeover requests
+    if ((handover_fd = handover_listen(handover_path)) < 0 || !adopt_listener(handover_fd))
+        lwsl_warn("[Signaling] Hot restart disabled\n");
+
+    lwsl_user("[Signaling] Server running on ws://localhost:%d\n", SIGNALING_PORT);
 
-    while (1) {
+    while (!handed_over || (session_count > 0 && lws_now_usecs() < drain_deadline)) {
         lwsl_user("[Signaling] Waiting for events...\n");
         lws_service(context, 1000);
     }
 
+    if (session_count > 0)
+        lwsl_warn("[Signaling] Drain timeout, dropping %d clients\n", session_count);
+    else
+        lwsl_user("[Signaling] Drain complete, exiting\n");
     lws_context_destroy(context);
     return 0;
 }
@@ -0,0 +1,158 @@
+// Stage tracing for the echo, signaling and media paths.
+//
+// TRACE_SPAN(name, category, start_us) marks the end of a stage that began
+// at start_us (a trace_now_us() timestamp). Built with -DHAVE_SYS_SDT_H it
+// is a USDT probe tenemp:<name>(start_us, duration_us), a single nop until
+// perf or bpftrace attaches to it. If the TRACE_DIR environment variable is
+// set, trace_init() also opens TRACE_DIR/<program>-<pid>.json and every
+// span is written there as a Chrome trace event (chrome://tracing or
+// ui.perfetto.dev). Timestamps are CLOCK_MONOTONIC, so files from processes
+// on the same host line up.
+//
+// Included after <gst/gst.h>, trace_gst_attach() additionally exports the
+// GStreamer latency tracer's per-element and per-pipeline latencies into
+// the same file; trace_init() enables that tracer when TRACE_DIR is set.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, start, dur) DTRACE_PROBE2(tenemp, name, start, dur)
+#else
+#define TRACE_PROBE(name, start, dur) do { (void)(start); (void)(dur); } while (0)
+#endif
+
+static FILE *trace_file = NULL;
+static int trace_events = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int64_t trace_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void trace_close(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Start writing trace events if TRACE_DIR is set. Call before gst_init().
+static inline void trace_init(const char *program)
+{
+    const char *dir = getenv("TRACE_DIR");
+    char path[4096];
+
+    if (!dir || !*dir)
+        return;
+
+    snprintf(path, sizeof(path), "%s/%s-%d.json", dir, program, (int)getpid());
+    if (!(trace_file = fopen(path, "w"))) {
+        perror("Cannot open trace file");
+        return;
+    }
+    fputs("[\n", trace_file);
+    atexit(trace_close);
+
+    setenv("GST_TRACERS", "latency(flags=pipeline+element)", 0);
+    fprintf(stderr, "Tracing to %s\n", path);
+}
+
+// Write one complete ("X") event. Names are escaped for JSON.
+static inline void trace_event(const char *name, const char *cat, int64_t start_us, int64_t dur_us)
+{
+    char escaped[256];
+    size_t n = 0;
+
+    if (!trace_file)
+        return;
+
+    for (const char *c = name; *c && n < sizeof(escaped) - 2; c++) {
+        if (*c == '"' || *c == '\\')
+            escaped[n++] = '\\';
+        escaped[n++] = (unsigned char)*c < 0x20 ? ' ' : *c;
+    }
+    escaped[n] = '\0';
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file)
+        fprintf(trace_file,
+                "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                "\"pid\":%d,\"tid\":%ld}",
+                trace_events++ ? ",\n" : "", escaped, cat, (long long)start_us,
+                (long long)dur_us, (int)getpid(), (long)syscall(SYS_gettid));
+    // Flushed per event, so a killed process still leaves a usable file
+    // (the trace viewers accept a missing closing bracket)
+    if (trace_file)
+        fflush(trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#define TRACE_SPAN(name, cat, start_us) do {                  \
+        int64_t trace_start_ = (start_us);                    \
+        int64_t trace_dur_ = trace_now_us() - trace_start_;   \
+        TRACE_PROBE(name, trace_start_, trace_dur_);          \
+        trace_event(#name, cat, trace_start_, trace_dur_);    \
+    } while (0)
+
+#ifdef __GST_H__
+// The latency tracer logs its records at TRACE level in the GST_TRACER
+// category; turn each into a span ending now. Everything else goes to the
+// default log handler as before.
+static inline void trace_gst_log(GstDebugCategory *category, GstDebugLevel level,
+                                 const gchar *file, const gchar *function, gint line,
+                                 GObject *object, GstDebugMessage *message, gpointer user_data)
+{
+    if (level == GST_LEVEL_TRACE && !strcmp(gst_debug_category_get_name(category), "GST_TRACER")) {
+        GstStructure *s = gst_structure_from_string(gst_debug_message_get(message), NULL);
+        guint64 time_ns;
+
+        if (s && gst_structure_get_uint64(s, "time", &time_ns)) {
+            int64_t dur = time_ns / 1000;
+            if (gst_structure_has_name(s, "element-latency")) {
+                const gchar *element = gst_structure_get_string(s, "element");
+                trace_event(element ? element : "element", "gst-element",
+                            trace_now_us() - dur, dur);
+            } else if (gst_structure_has_name(s, "latency")) {
+                gchar *name = g_strdup_printf("%s -> %s",
+                                              gst_structure_get_string(s, "src-element"),
+                                              gst_structure_get_string(s, "sink-element"));
+                trace_event(name, "gst-pipeline", trace_now_us() - dur, dur);
+                g_free(name);
+            }
+        }
+        if (s)
+            gst_structure_free(s);
+        return;
+    }
+    gst_debug_log_default(category, level, file, function, line, object, message, NULL);
+}
+
+// Call after gst_init()
+static inline void trace_gst_attach(void)
+{
+    if (!trace_file)
+        return;
+    gst_debug_set_threshold_for_name("GST_TRACER", GST_LEVEL_TRACE);
+    gst_debug_remove_log_function(gst_debug_log_default);
+    gst_debug_add_log_function(trace_gst_log, NULL, NULL);
+}
+#endif
+
+#endif